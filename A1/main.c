@@ -6,9 +6,35 @@
 *  Assignment 1: Movies
 */
 
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Sketch sizes for the approximate statistics mode */
+#define YEAR_MIN 1900
+#define YEAR_SLOTS 122
+#define HLL_BITS 6
+#define HLL_REGS (1 << HLL_BITS)
+#define LANG_SLOTS 32
+#define CMS_DEPTH 4
+#define CMS_WIDTH 256
+#define SUMMARY_MAGIC "MVSKTCH1"
+
+/* Radix sort tuning: 8 bit digits, at most SORT_MAX_THREADS threads */
+#define RADIX 256
+#define SORT_MAX_THREADS 16
+#define SORT_MIN_PER_THREAD 65536
+
+/* External sort: default memory budget, largest merge fan-in and I/O buffer */
+#define SORT_MEMORY_MB 256
+#define MERGE_MAX_RUNS 256
+#define SORT_IO_BUFFER (1 << 20)
 
 /* struct for movie information */
 struct movie
@@ -19,23 +45,161 @@ struct movie
     char languages[5][21];
     int num_lang;
     double rating;
+    char *row;
     struct movie *next;
 };
 
+/*
+*  State of a file loaded with --lazy: the whole file stays in lazyBuffer,
+*  the movies are one block of nodes pointing at their rows, and the
+*  fields other than the year are decoded the first time they are needed.
+*/
+char *lazyBuffer = NULL;
+struct movie *lazyNodes = NULL;
+int lazyDecoded = 0;
+
+/* Phases reported by --stats */
+enum phase
+{
+    PHASE_READ,
+    PHASE_TOKENIZE,
+    PHASE_ALLOCATE,
+    PHASE_INDEX,
+    PHASE_QUERY,
+    PHASE_OUTPUT,
+    NUM_PHASES
+};
+
+const char *phaseNames[NUM_PHASES] = {"read", "tokenize", "allocate", "index build", "query", "output"};
+
+/*
+*  Counters collected with --stats. Phases nest (allocations happen while
+*  tokenizing, output while querying), and each phase only counts the time
+*  not already counted by a phase inside it, kept track of with nestedNs.
+*/
+struct phaseStats
+{
+    long long ns[NUM_PHASES];
+    long long bytes[NUM_PHASES];
+    long long calls[NUM_PHASES];
+    long long nestedNs;
+};
+
+/* Start of a timed phase */
+struct statTimer
+{
+    long long start;
+    long long nested;
+};
+
+int statsEnabled = 0;
+struct phaseStats stats;
+
+/*
+* Monotonic clock in nanoseconds
+*/
+static inline long long statsClock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+* Start timing a phase. Does nothing unless --stats was given.
+*/
+static inline struct statTimer statsBegin()
+{
+    struct statTimer timer = {0, 0};
+    if (statsEnabled)
+    {
+        timer.start = statsClock();
+        timer.nested = stats.nestedNs;
+    }
+    return timer;
+}
+
+/*
+* Finish timing a phase and add the bytes it handled
+*/
+static inline void statsEnd(int phase, struct statTimer timer, long long bytes)
+{
+    if (!statsEnabled)
+    {
+        return;
+    }
+    long long elapsed = statsClock() - timer.start;
+    stats.ns[phase] += elapsed - (stats.nestedNs - timer.nested);
+    stats.nestedNs = timer.nested + elapsed;
+    stats.bytes[phase] += bytes;
+    stats.calls[phase]++;
+}
+
+/*
+* malloc and calloc that are counted in the allocate phase
+*/
+void *statMalloc(size_t size)
+{
+    struct statTimer timer = statsBegin();
+    void *ptr = malloc(size);
+    statsEnd(PHASE_ALLOCATE, timer, size);
+    return ptr;
+}
+
+void *statCalloc(size_t num, size_t size)
+{
+    struct statTimer timer = statsBegin();
+    void *ptr = calloc(num, size);
+    statsEnd(PHASE_ALLOCATE, timer, num * size);
+    return ptr;
+}
+
+/*
+* printf for query results, counted in the output phase
+*/
+int outputf(const char *format, ...)
+{
+    struct statTimer timer = statsBegin();
+    va_list args;
+    va_start(args, format);
+    int written = vprintf(format, args);
+    va_end(args);
+    statsEnd(PHASE_OUTPUT, timer, written);
+    return written;
+}
+
+/*
+* Print the counters collected with --stats to stderr
+*/
+void printStats()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "\n%-12s %12s %14s %12s\n", "phase", "time (ms)", "bytes", "calls");
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        fprintf(stderr, "%-12s %12.3f %14lld %12lld\n", phaseNames[i],
+                stats.ns[i] / 1e6, stats.bytes[i], stats.calls[i]);
+    }
+    fprintf(stderr, "allocations: %lld (%lld bytes)\n", stats.calls[PHASE_ALLOCATE],
+            stats.bytes[PHASE_ALLOCATE]);
+    fprintf(stderr, "peak RSS: %ld KB\n", usage.ru_maxrss);
+}
+
 /* 
 *  Parse the current line which is space delimited and create a
 *  movie struct with the data in this line
 */
 struct movie *createMovie(char *currLine)
 {
-    struct movie *currMovie = malloc(sizeof(struct movie));
+    struct movie *currMovie = statMalloc(sizeof(struct movie));
 
     // For use with strtok_r
     char *saveptr;
 
     // The first token is the title
     char *token = strtok_r(currLine, ",", &saveptr);
-    currMovie->title = calloc(strlen(token) + 1, sizeof(char));
+    currMovie->title = statCalloc(strlen(token) + 1, sizeof(char));
     strcpy(currMovie->title, token);
 
     // The next token is the year
@@ -44,7 +208,7 @@ struct movie *createMovie(char *currLine)
 
     // The next token is the languages
     token = strtok_r(NULL, ",", &saveptr);
-    currMovie->lang = calloc(strlen(token) + 1, sizeof(char));
+    currMovie->lang = statCalloc(strlen(token) + 1, sizeof(char));
     strcpy(currMovie->lang, token);
 
     // token2 is used to hold language substrings of token
@@ -66,6 +230,7 @@ struct movie *createMovie(char *currLine)
     currMovie->rating = atof(token);
 
     // Set the next node to NULL in the newly created movie entry
+    currMovie->row = NULL;
     currMovie->next = NULL;
 
     return currMovie;
@@ -92,8 +257,10 @@ struct movie *processFile(char *filePath)
     struct movie *tail = NULL;
 
     // Read the file line by line
+    struct statTimer timer = statsBegin();
     while ((nread = getline(&currLine, &len, movieFile)) != -1)
     {
+        statsEnd(PHASE_READ, timer, nread);
         if (count == -1)
         {
             count++;
@@ -101,7 +268,9 @@ struct movie *processFile(char *filePath)
         else
         {
             // Get a new movie node corresponding to the current line
+            timer = statsBegin();
             struct movie *newNode = createMovie(currLine);
+            statsEnd(PHASE_TOKENIZE, timer, nread);
             count++;
 
             // Is this the first node in the linked list?
@@ -120,6 +289,7 @@ struct movie *processFile(char *filePath)
                 tail = newNode;
             }
         }
+        timer = statsBegin();
     }
     free(currLine);
     fclose(movieFile);
@@ -127,6 +297,154 @@ struct movie *processFile(char *filePath)
     return head;
 }
 
+/*
+* Return a linked list of movies that only records where each row starts
+* and its year. The file is read with a single fread and every row stays
+* in lazyBuffer until decodeMovies fills in the other fields.
+*/
+struct movie *processFileLazy(char *filePath)
+{
+    FILE *movieFile = fopen(filePath, "r");
+    if (movieFile == NULL)
+    {
+        perror(filePath);
+        exit(1);
+    }
+    fseek(movieFile, 0, SEEK_END);
+    long size = ftell(movieFile);
+    rewind(movieFile);
+    lazyBuffer = statMalloc(size + 1);
+    struct statTimer timer = statsBegin();
+    size = fread(lazyBuffer, 1, size, movieFile);
+    statsEnd(PHASE_READ, timer, size);
+    lazyBuffer[size] = '\0';
+    fclose(movieFile);
+
+    // Count the rows first so all the nodes can be allocated at once
+    int rows = 0;
+    for (char *p = lazyBuffer; (p = memchr(p, '\n', lazyBuffer + size - p)) != NULL; p++)
+    {
+        rows++;
+    }
+    lazyNodes = statCalloc(rows + 1, sizeof(struct movie));
+
+    timer = statsBegin();
+    int count = 0;
+    char *line = lazyBuffer;
+    char *end = lazyBuffer + size;
+    // Skip the header line
+    char *newline = memchr(line, '\n', end - line);
+    line = (newline == NULL) ? end : newline + 1;
+
+    while (line < end)
+    {
+        newline = memchr(line, '\n', end - line);
+        if (newline != NULL)
+        {
+            *newline = '\0';
+        }
+        char *comma = strchr(line, ',');
+        if (comma != NULL)
+        {
+            struct movie *node = &lazyNodes[count];
+            node->row = line;
+            node->year = atoi(comma + 1);
+            if (count > 0)
+            {
+                lazyNodes[count - 1].next = node;
+            }
+            count++;
+        }
+        line = (newline == NULL) ? end : newline + 1;
+    }
+    statsEnd(PHASE_TOKENIZE, timer, size);
+    printf("Processed file %s and parsed data for %i movies\n", filePath, count);
+    return (count > 0) ? lazyNodes : NULL;
+}
+
+/*
+* Decode the title, languages and rating of every lazily loaded movie.
+* The rows are split in place, so the title and language string point into
+* lazyBuffer and only the individual languages are copied.
+*/
+void decodeMovies(struct movie *list)
+{
+    if (lazyBuffer == NULL || lazyDecoded)
+    {
+        return;
+    }
+    struct statTimer timer = statsBegin();
+    for (; list != NULL; list = list->next)
+    {
+        char *field = list->row;
+        char *comma = strchr(field, ',');
+        *comma = '\0';
+        list->title = field;
+
+        // Skip the year, which was decoded at load time
+        field = strchr(comma + 1, ',');
+        if (field == NULL)
+        {
+            continue;
+        }
+        field++;
+        comma = strchr(field, ',');
+        if (comma != NULL)
+        {
+            *comma = '\0';
+            list->rating = atof(comma + 1);
+        }
+        list->lang = field;
+
+        // Copy each language between the '[ ]', separated by ';'
+        char *lang = (*field == '[') ? field + 1 : field;
+        int i = 0;
+        while (*lang != '\0' && *lang != ']' && i < 5)
+        {
+            int len = strcspn(lang, ";]");
+            int copy = (len > 20) ? 20 : len;
+            memcpy(list->languages[i], lang, copy);
+            list->languages[i][copy] = '\0';
+            i++;
+            lang += len;
+            if (*lang == ';')
+            {
+                lang++;
+            }
+        }
+        list->num_lang = i;
+    }
+    statsEnd(PHASE_INDEX, timer, 0);
+    lazyDecoded = 1;
+}
+
+/*
+* Print the title of a movie, which for a lazily loaded movie that has
+* not been decoded yet is the start of its row up to the first comma
+*/
+void printTitle(struct movie *aMovie)
+{
+    if (aMovie->title != NULL)
+    {
+        outputf("%s\n", aMovie->title);
+    }
+    else
+    {
+        outputf("%.*s\n", (int)strcspn(aMovie->row, ","), aMovie->row);
+    }
+}
+
+/*
+* Free a lazily loaded list, whose nodes and strings live in two blocks
+*/
+void freeLazy()
+{
+    free(lazyNodes);
+    free(lazyBuffer);
+    lazyNodes = NULL;
+    lazyBuffer = NULL;
+}
+
 /*
 * Print data for the given movie
 */
@@ -166,173 +484,1222 @@ void freeMovie(struct movie *list)
     }
 }
 
+/* 
+*  Mergeable summary used by the approximate mode. Distinct titles are
+*  counted with a HyperLogLog per year and per language, and language
+*  frequency with a count-min sketch. The whole struct is about 15 KB
+*  and is written to disk as-is so summaries of several files can be merged.
+*/
+struct summary
+{
+    char magic[8];
+    unsigned long long rows;
+    unsigned int yearRows[YEAR_SLOTS];
+    unsigned char yearHll[YEAR_SLOTS][HLL_REGS];
+    int num_lang;
+    char langNames[LANG_SLOTS][21];
+    unsigned char langHll[LANG_SLOTS][HLL_REGS];
+    unsigned int cms[CMS_DEPTH][CMS_WIDTH];
+};
+
 /*
-* Print the user instruction and read in choices
+* 64 bit FNV-1a hash of a string followed by a final mix so that
+* the top bits are usable as a HyperLogLog register index
 */
-int instructions()
+unsigned long long hashString(const char *str)
 {
-    int i = 0;
-    while (i < 1 || i > 4)
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    while (*str)
     {
-        printf("\n1. Show movies released in the specified year\n"
-                "2. Show highest rated movie for each year\n"
-                "3. Show the title and year of release of all movies in a specific language\n"
-                "4. Exit from the program\n"
-                "\nEnter a choice from 1 to 4: ");
-        scanf("%i", &i);
+        h ^= (unsigned char)*str++;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+* Add a hashed value to a HyperLogLog, keeping the longest run of
+* leading zeros seen in each register
+*/
+void hllAdd(unsigned char *regs, unsigned long long h)
+{
+    int idx = h >> (64 - HLL_BITS);
+    unsigned long long rest = h << HLL_BITS;
+    int rank = (rest == 0) ? (64 - HLL_BITS + 1) : __builtin_clzll(rest) + 1;
+    if (regs[idx] < rank)
+    {
+        regs[idx] = rank;
+    }
+}
 
-        // only continue with integer inputs between 1 and 4
-        if (i < 1 || i > 4)
+/*
+* Estimate the number of distinct values added to a HyperLogLog,
+* using linear counting for small cardinalities
+*/
+double hllCount(const unsigned char *regs)
+{
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGS; i++)
+    {
+        sum += ldexp(1.0, -regs[i]);
+        if (regs[i] == 0)
         {
-            printf("You entered an incorrect choice. Try again.\n");
+            zeros++;
         }
     }
-    return i;
+    double estimate = 0.709 * HLL_REGS * HLL_REGS / sum;
+    if (estimate <= 2.5 * HLL_REGS && zeros > 0)
+    {
+        estimate = HLL_REGS * log((double)HLL_REGS / zeros);
+    }
+    return estimate;
 }
 
 /*
-* Show movies released in a certain year
+* Count-min sketch column for row i, derived from one hash
 */
-void optionOne(struct movie *list)
+int cmsIndex(unsigned long long h, int i)
 {
-    int i;
-    int temp = 0;
+    unsigned int h1 = h;
+    unsigned int h2 = h >> 32;
+    return (h1 + i * h2) % CMS_WIDTH;
+}
 
-    // User will enter a year value
-    printf("Enter the year for which you want to see movies: ");
-    scanf("%i", &i);
-    while (list != NULL)
+/*
+* Estimated number of occurrences of a language in the count-min sketch
+*/
+unsigned int cmsCount(struct summary *sum, const char *lang)
+{
+    unsigned long long h = hashString(lang);
+    unsigned int min = sum->cms[0][cmsIndex(h, 0)];
+    for (int i = 1; i < CMS_DEPTH; i++)
     {
-        // all movies with equivalent years will be printed
-        if (list->year == i) {
-            printf("%s\n", list->title);
-            temp = 1;
+        if (sum->cms[i][cmsIndex(h, i)] < min)
+        {
+            min = sum->cms[i][cmsIndex(h, i)];
         }
-        list = list->next;
     }
+    return min;
+}
 
-    // if no movie has a matching year, print message
-    if (temp == 0)
+/*
+* Return the slot of a language in the summary, adding it if there is room.
+* Names are stored truncated to 20 characters and compared the same way.
+* Returns -1 when the language table is full, the language is then only
+* counted by the count-min sketch.
+*/
+int langSlot(struct summary *sum, const char *lang)
+{
+    for (int i = 0; i < sum->num_lang; i++)
     {
-        printf("No data about movies released in the year %i\n", i);
+        if (strncmp(sum->langNames[i], lang, 20) == 0)
+        {
+            return i;
+        }
+    }
+    if (sum->num_lang == LANG_SLOTS)
+    {
+        return -1;
     }
+    strncpy(sum->langNames[sum->num_lang], lang, 20);
+    return sum->num_lang++;
 }
 
 /*
-* Show highest rated movie for each year
+* Add one csv line to the summary without allocating a movie struct.
+* The line is tokenized in place the same way createMovie does.
 */
-void optionTwo(struct movie *list)
+void sketchLine(struct summary *sum, char *currLine)
 {
-    // Create an array from years 1900 to 2021 that holds pointers to a struct
-    struct movie *highest[122];
-    for (int i = 0; i < 122; i++)
+    char *saveptr;
+    char *title = strtok_r(currLine, ",", &saveptr);
+    char *token = strtok_r(NULL, ",", &saveptr);
+    if (title == NULL || token == NULL)
     {
-        highest[i] = NULL;
+        return;
     }
+    int year = atoi(token);
+    unsigned long long h = hashString(title);
+    sum->rows++;
 
-    // for every movie in the list compare rating to the same year movies
-    while (list != NULL)
+    if (year >= YEAR_MIN && year < YEAR_MIN + YEAR_SLOTS)
     {
-        if (highest[((list->year) - 1900)] == NULL)
-        {
-            highest[((list->year) - 1900)] = list;
-        }
-        else if (highest[((list->year) - 1900)]->rating < list->rating) {
-            highest[((list->year) - 1900)] = list;
-        }
+        sum->yearRows[year - YEAR_MIN]++;
+        hllAdd(sum->yearHll[year - YEAR_MIN], h);
+    }
 
-        list = list->next;
+    // The next token is the languages, remove the '[ ]' and split on ';'
+    token = strtok_r(NULL, ",", &saveptr);
+    if (token == NULL || strlen(token) < 2)
+    {
+        return;
     }
+    token++;
+    token[strlen(token) - 1] = 0;
 
-    // print out every highest rating per year
-    for (int i = 0; i < 122; i++)
+    char *token2;
+    while ((token2 = strtok_r(token, ";", &token)))
     {
-        if (highest[i] != NULL)
+        // Languages are kept to 20 characters, so the sketch counts the stored name
+        if (strlen(token2) > 20)
+        {
+            token2[20] = 0;
+        }
+        unsigned long long lh = hashString(token2);
+        for (int i = 0; i < CMS_DEPTH; i++)
         {
-            printf("%i %0.1f %s\n", highest[i]->year, highest[i]->rating, highest[i]->title);
+            sum->cms[i][cmsIndex(lh, i)]++;
+        }
+        int slot = langSlot(sum, token2);
+        if (slot >= 0)
+        {
+            hllAdd(sum->langHll[slot], h);
         }
     }
 }
 
 /*
-* Show movies and their year of release for a specific language
+* Merge summary b into summary a. Registers take the maximum
+* and counters are added, so the result matches a single pass over both inputs.
 */
-void optionThree(struct movie *list)
+void mergeSummary(struct summary *a, struct summary *b)
 {
-    char temp_lang[21];
-    int temp = 0;
-
-    // Ask user for desired language
-    printf("Enter the language for which you want to see movies: ");
-    scanf("%s", temp_lang);
-
-    // For every movie, check if it has the desired langauge
-    // If language is found, print year and title of movie
-    while (list != NULL)
+    a->rows += b->rows;
+    for (int y = 0; y < YEAR_SLOTS; y++)
     {
-        for (int i = 0; i < list->num_lang; i++)
+        a->yearRows[y] += b->yearRows[y];
+        for (int r = 0; r < HLL_REGS; r++)
         {
-            if (strcmp(list->languages[i], temp_lang) == 0) {
-                printf("%i %s\n", list->year, list->title);
-                temp = 1;
+            if (a->yearHll[y][r] < b->yearHll[y][r])
+            {
+                a->yearHll[y][r] = b->yearHll[y][r];
             }
         }
-        
-        list = list->next;
     }
-
-    // If data does not include any movie in the language, print message
-    if (temp == 0)
+    for (int l = 0; l < b->num_lang; l++)
+    {
+        int slot = langSlot(a, b->langNames[l]);
+        if (slot < 0)
+        {
+            continue;
+        }
+        for (int r = 0; r < HLL_REGS; r++)
+        {
+            if (a->langHll[slot][r] < b->langHll[l][r])
+            {
+                a->langHll[slot][r] = b->langHll[l][r];
+            }
+        }
+    }
+    for (int i = 0; i < CMS_DEPTH; i++)
     {
-        printf("No data about movies released in %s\n", temp_lang);
+        for (int j = 0; j < CMS_WIDTH; j++)
+        {
+            a->cms[i][j] += b->cms[i][j];
+        }
     }
 }
 
 /*
-*   Process the file provided as an argument to the program to
-*   create a linked list of movie structs and follow user instructions.
-*   Compile the program as follows:
-*       gcc --std=gnu99 -o movies main.c
+* Build a summary for a file. The file is either a movie csv, which is
+* streamed once, or a summary previously saved with --save.
+* Returns 0 on success and -1 if the file cannot be read.
 */
-
-int main(int argc, char *argv[])
+int summarizeFile(char *filePath, struct summary *sum)
 {
-    if (argc < 2)
+    FILE *movieFile = fopen(filePath, "r");
+    if (movieFile == NULL)
     {
-        printf("You must provide the name of the file to process\n");
-        printf("Example usage: ./movie.exe movies_sample_1.csv\n");
-        return EXIT_FAILURE;
+        perror(filePath);
+        return -1;
     }
-    struct movie *list = processFile(argv[1]);
-    //printMovieList(list);
-    int cont = 0;
 
-    // while the program runs, print out instructions and run user choices
-    while (cont == 0)
+    memset(sum, 0, sizeof(struct summary));
+    memcpy(sum->magic, SUMMARY_MAGIC, 8);
+
+    // A saved summary starts with the magic bytes and is loaded directly
+    char magic[8];
+    if (fread(magic, 1, 8, movieFile) == 8 && memcmp(magic, SUMMARY_MAGIC, 8) == 0)
     {
-        int i = instructions();
-        
-        if (i == 1)
+        rewind(movieFile);
+        int ok = fread(sum, sizeof(struct summary), 1, movieFile);
+        fclose(movieFile);
+        if (ok != 1)
         {
-            optionOne(list);
+            printf("Summary file %s is truncated\n", filePath);
+            return -1;
         }
-
-        if (i == 2)
+        if (sum->num_lang < 0 || sum->num_lang > LANG_SLOTS)
         {
-            optionTwo(list);
+            printf("Summary file %s is corrupt\n", filePath);
+            return -1;
         }
-
+        for (int i = 0; i < sum->num_lang; i++)
+        {
+            sum->langNames[i][20] = 0;
+        }
+        return 0;
+    }
+    rewind(movieFile);
+
+    char *currLine = NULL;
+    size_t len = 0;
+    int header = 1;
+
+    // Skip the header line and sketch every other line
+    while (getline(&currLine, &len, movieFile) != -1)
+    {
+        if (header)
+        {
+            header = 0;
+        }
+        else
+        {
+            sketchLine(sum, currLine);
+        }
+    }
+    free(currLine);
+    fclose(movieFile);
+    return 0;
+}
+
+/*
+* Print the approximate per year and per language statistics
+*/
+void printSummary(struct summary *sum)
+{
+    printf("Approximate statistics for %llu movies (summary size %zu bytes)\n",
+            sum->rows, sizeof(struct summary));
+    printf("\nYear  Movies  ~Distinct titles\n");
+    for (int y = 0; y < YEAR_SLOTS; y++)
+    {
+        if (sum->yearRows[y] > 0)
+        {
+            printf("%i  %u  %.0f\n", y + YEAR_MIN, sum->yearRows[y], hllCount(sum->yearHll[y]));
+        }
+    }
+    printf("\nLanguage  ~Movies  ~Distinct titles\n");
+    for (int l = 0; l < sum->num_lang; l++)
+    {
+        printf("%s  %u  %.0f\n", sum->langNames[l], cmsCount(sum, sum->langNames[l]),
+                hllCount(sum->langHll[l]));
+    }
+}
+
+/*
+* Approximate mode: summarize every file given on the command line,
+* merge the summaries, print them and optionally save the merged summary.
+*   ./movies --approx [--save summary.bin] file1.csv [file2.csv | summary.bin ...]
+*/
+int approxMode(int argc, char *argv[])
+{
+    char *savePath = NULL;
+    int first = 0;
+    if (argc >= 2 && strcmp(argv[0], "--save") == 0)
+    {
+        savePath = argv[1];
+        first = 2;
+    }
+    if (first >= argc)
+    {
+        printf("You must provide at least one file to summarize\n");
+        printf("Example usage: ./movies --approx [--save summary.bin] movies_sample_1.csv\n");
+        return EXIT_FAILURE;
+    }
+
+    struct summary *total = malloc(sizeof(struct summary));
+    struct summary *curr = malloc(sizeof(struct summary));
+    memset(total, 0, sizeof(struct summary));
+    memcpy(total->magic, SUMMARY_MAGIC, 8);
+
+    for (int i = first; i < argc; i++)
+    {
+        if (summarizeFile(argv[i], curr) == -1)
+        {
+            free(total);
+            free(curr);
+            return EXIT_FAILURE;
+        }
+        mergeSummary(total, curr);
+    }
+    printSummary(total);
+
+    if (savePath != NULL)
+    {
+        FILE *out = fopen(savePath, "w");
+        if (out == NULL || fwrite(total, sizeof(struct summary), 1, out) != 1)
+        {
+            perror(savePath);
+        }
+        if (out != NULL)
+        {
+            fclose(out);
+        }
+    }
+    free(total);
+    free(curr);
+    return EXIT_SUCCESS;
+}
+
+/* 
+*  Fixed width sort key of a movie and the index of the movie it belongs to.
+*  The key orders by year ascending and then rating descending.
+*/
+struct sortRecord
+{
+    unsigned int key;
+    unsigned int idx;
+};
+
+/* Work given to one thread for one pass of the radix sort */
+struct radixJob
+{
+    struct sortRecord *src;
+    struct sortRecord *dst;
+    size_t begin;
+    size_t end;
+    int shift;
+    size_t count[RADIX];
+};
+
+/*
+* Build the sort key for a year and rating: the year in the top 16 bits and the
+* rating in tenths, inverted so higher ratings sort first, in the low 16 bits
+*/
+unsigned int packKey(int year, double rating)
+{
+    int tenths = (int)(rating * 10 + 0.5);
+    if (year < 0)
+    {
+        year = 0;
+    }
+    if (year > 0xFFFF)
+    {
+        year = 0xFFFF;
+    }
+    if (tenths < 0)
+    {
+        tenths = 0;
+    }
+    if (tenths > 0xFFFF)
+    {
+        tenths = 0xFFFF;
+    }
+    return ((unsigned int)year << 16) | (0xFFFF - tenths);
+}
+
+/*
+* Build the sort key for a movie
+*/
+unsigned int sortKey(struct movie *aMovie)
+{
+    return packKey(aMovie->year, aMovie->rating);
+}
+
+/*
+* Count the digits of one slice of the records for the current pass
+*/
+void *radixHistogram(void *arg)
+{
+    struct radixJob *job = arg;
+    memset(job->count, 0, sizeof(job->count));
+    for (size_t i = job->begin; i < job->end; i++)
+    {
+        job->count[(job->src[i].key >> job->shift) & (RADIX - 1)]++;
+    }
+    return NULL;
+}
+
+/*
+* Move one slice of the records to its place in the destination array.
+* job->count holds the first output position of each digit for this slice.
+*/
+void *radixScatter(void *arg)
+{
+    struct radixJob *job = arg;
+    for (size_t i = job->begin; i < job->end; i++)
+    {
+        int digit = (job->src[i].key >> job->shift) & (RADIX - 1);
+        job->dst[job->count[digit]++] = job->src[i];
+    }
+    return NULL;
+}
+
+/*
+* Run func on every job, on its own thread when there is more than one job
+*/
+void runJobs(struct radixJob *jobs, int threads, void *(*func)(void *))
+{
+    pthread_t tid[SORT_MAX_THREADS];
+    if (threads == 1)
+    {
+        func(&jobs[0]);
+        return;
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_create(&tid[t], NULL, func, &jobs[t]);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(tid[t], NULL);
+    }
+}
+
+/*
+* Parallel LSD radix sort of n records on their 32 bit key.
+* Each pass splits the records into one slice per thread, counts digits per
+* slice, turns the counts into per slice output offsets and scatters the slices
+* concurrently, which keeps the sort stable. Passes where every key has the same
+* digit are skipped, so the constant high bytes of year and rating cost nothing.
+* Returns whichever of recs and tmp holds the sorted output.
+*/
+struct sortRecord *radixSort(struct sortRecord *recs, struct sortRecord *tmp, size_t n)
+{
+    struct radixJob jobs[SORT_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = n / SORT_MIN_PER_THREAD;
+    if (threads > cpus)
+    {
+        threads = cpus;
+    }
+    if (threads > SORT_MAX_THREADS)
+    {
+        threads = SORT_MAX_THREADS;
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        for (int t = 0; t < threads; t++)
+        {
+            jobs[t].src = recs;
+            jobs[t].dst = tmp;
+            jobs[t].begin = n * t / threads;
+            jobs[t].end = n * (t + 1) / threads;
+            jobs[t].shift = shift;
+        }
+        runJobs(jobs, threads, radixHistogram);
+
+        // Skip the pass if all records share the same digit
+        int skip = 0;
+        for (int d = 0; d < RADIX && !skip; d++)
+        {
+            size_t total = 0;
+            for (int t = 0; t < threads; t++)
+            {
+                total += jobs[t].count[d];
+            }
+            if (total == n)
+            {
+                skip = 1;
+            }
+        }
+        if (skip)
+        {
+            continue;
+        }
+
+        // Turn the counts into output offsets, ordered by digit and then by slice
+        size_t offset = 0;
+        for (int d = 0; d < RADIX; d++)
+        {
+            for (int t = 0; t < threads; t++)
+            {
+                size_t c = jobs[t].count[d];
+                jobs[t].count[d] = offset;
+                offset += c;
+            }
+        }
+        runJobs(jobs, threads, radixScatter);
+
+        struct sortRecord *swap = recs;
+        recs = tmp;
+        tmp = swap;
+    }
+    return recs;
+}
+
+/*
+* qsort comparison of two movie pointers by title
+*/
+int compareTitle(const void *a, const void *b)
+{
+    struct movie *const *x = a;
+    struct movie *const *y = b;
+    return strcmp((*x)->title, (*y)->title);
+}
+
+/*
+* Return an array of the n movies in the list ordered by year, then by
+* rating descending and then by title. The caller frees the array.
+*/
+struct movie **sortMovies(struct movie *list, size_t *n)
+{
+    struct statTimer timer = statsBegin();
+    size_t count = 0;
+    for (struct movie *curr = list; curr != NULL; curr = curr->next)
+    {
+        count++;
+    }
+
+    struct movie **movies = statMalloc((count + 1) * sizeof(struct movie *));
+    struct sortRecord *recs = statMalloc((count + 1) * sizeof(struct sortRecord));
+    struct sortRecord *tmp = statMalloc((count + 1) * sizeof(struct sortRecord));
+    size_t i = 0;
+    for (struct movie *curr = list; curr != NULL; curr = curr->next)
+    {
+        movies[i] = curr;
+        recs[i].key = sortKey(curr);
+        recs[i].idx = i;
+        i++;
+    }
+
+    struct sortRecord *sorted = radixSort(recs, tmp, count);
+    struct movie **result = statMalloc((count + 1) * sizeof(struct movie *));
+    for (i = 0; i < count; i++)
+    {
+        result[i] = movies[sorted[i].idx];
+    }
+
+    // Movies with the same year and rating are ordered by title
+    size_t start = 0;
+    for (i = 1; i <= count; i++)
+    {
+        if (i == count || sorted[i].key != sorted[start].key)
+        {
+            if (i - start > 1)
+            {
+                qsort(&result[start], i - start, sizeof(struct movie *), compareTitle);
+            }
+            start = i;
+        }
+    }
+
+    free(movies);
+    free(recs);
+    free(tmp);
+    statsEnd(PHASE_INDEX, timer, count * sizeof(struct sortRecord));
+    *n = count;
+    return result;
+}
+
+/* One sorted run being read back during the k-way merge */
+struct mergeRun
+{
+    FILE *file;
+    char *buffer;
+    char *line;
+    size_t len;
+    unsigned int key;
+    int done;
+};
+
+/*
+* Compare two csv lines by their title, which ends at the first comma
+*/
+int compareLineTitle(const char *a, const char *b)
+{
+    while (*a == *b && *a != ',' && *a != '\0')
+    {
+        a++;
+        b++;
+    }
+    unsigned char x = (*a == ',') ? 0 : *a;
+    unsigned char y = (*b == ',') ? 0 : *b;
+    return x - y;
+}
+
+/*
+* Compare two csv line pointers by title for qsort
+*/
+int compareLinePtr(const void *a, const void *b)
+{
+    return compareLineTitle(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+* Sort key of a csv line. The year and rating fields are read in place,
+* the languages field between them never contains a comma.
+*/
+unsigned int lineKey(const char *line)
+{
+    const char *year = strchr(line, ',');
+    const char *rating = (year != NULL) ? strchr(year + 1, ',') : NULL;
+    if (rating != NULL)
+    {
+        rating = strchr(rating + 1, ',');
+    }
+    if (rating == NULL)
+    {
+        return packKey(0, 0);
+    }
+    return packKey(atoi(year + 1), atof(rating + 1));
+}
+
+/*
+* Return nonzero if run a should be output before run b.
+* Exhausted runs sort after everything else.
+*/
+int runBefore(struct mergeRun *runs, int a, int b)
+{
+    if (runs[a].done || runs[b].done)
+    {
+        return !runs[a].done;
+    }
+    if (runs[a].key != runs[b].key)
+    {
+        return runs[a].key < runs[b].key;
+    }
+    return compareLineTitle(runs[a].line, runs[b].line) <= 0;
+}
+
+/*
+* Read the next line of a run and compute its key
+*/
+void advanceRun(struct mergeRun *run)
+{
+    if (getline(&run->line, &run->len, run->file) == -1)
+    {
+        run->done = 1;
+        return;
+    }
+    run->key = lineKey(run->line);
+}
+
+/*
+* Replay the loser tree from leaf s up to the root. Internal nodes hold the
+* loser of the match played there and tree[0] holds the overall winner.
+* A node set to -1 is still empty while the tree is being built.
+*/
+void adjustLoserTree(struct mergeRun *runs, int *tree, int k, int s)
+{
+    int winner = s;
+    for (int p = (s + k) / 2; p > 0; p /= 2)
+    {
+        if (tree[p] == -1)
+        {
+            tree[p] = winner;
+            return;
+        }
+        if (runBefore(runs, tree[p], winner))
+        {
+            int swap = tree[p];
+            tree[p] = winner;
+            winner = swap;
+        }
+    }
+    tree[0] = winner;
+}
+
+/*
+* Merge k sorted run files into out with a loser tree, so each output line
+* costs log2(k) comparisons. The run files are closed.
+*/
+void mergeRuns(FILE **files, int k, FILE *out, size_t bufferSize)
+{
+    struct mergeRun *runs = calloc(k, sizeof(struct mergeRun));
+    int *tree = malloc(k * sizeof(int));
+    // There is always at least one run, tree[0] names the winner once the tree is built
+    tree[0] = 0;
+
+    for (int i = 0; i < k; i++)
+    {
+        runs[i].file = files[i];
+        runs[i].buffer = malloc(bufferSize);
+        setvbuf(files[i], runs[i].buffer, _IOFBF, bufferSize);
+        rewind(files[i]);
+        advanceRun(&runs[i]);
+        tree[i] = -1;
+    }
+    for (int i = k - 1; i >= 0; i--)
+    {
+        adjustLoserTree(runs, tree, k, i);
+    }
+
+    while (!runs[tree[0]].done)
+    {
+        int w = tree[0];
+        fputs(runs[w].line, out);
+        advanceRun(&runs[w]);
+        adjustLoserTree(runs, tree, k, w);
+    }
+
+    for (int i = 0; i < k; i++)
+    {
+        fclose(runs[i].file);
+        free(runs[i].buffer);
+        free(runs[i].line);
+    }
+    free(runs);
+    free(tree);
+}
+
+/*
+* Sort the buffered lines in memory with the radix sort and write them to
+* a new temporary run file, which is returned
+*/
+FILE *writeRun(char **lines, size_t n)
+{
+    struct sortRecord *recs = malloc((n + 1) * sizeof(struct sortRecord));
+    struct sortRecord *tmp = malloc((n + 1) * sizeof(struct sortRecord));
+    for (size_t i = 0; i < n; i++)
+    {
+        recs[i].key = lineKey(lines[i]);
+        recs[i].idx = i;
+    }
+    struct sortRecord *sorted = radixSort(recs, tmp, n);
+    char **ordered = malloc((n + 1) * sizeof(char *));
+    for (size_t i = 0; i < n; i++)
+    {
+        ordered[i] = lines[sorted[i].idx];
+    }
+
+    // Lines with the same year and rating are ordered by title
+    size_t start = 0;
+    for (size_t i = 1; i <= n; i++)
+    {
+        if (i == n || sorted[i].key != sorted[start].key)
+        {
+            if (i - start > 1)
+            {
+                qsort(&ordered[start], i - start, sizeof(char *), compareLinePtr);
+            }
+            start = i;
+        }
+    }
+
+    FILE *run = tmpfile();
+    if (run == NULL)
+    {
+        perror("tmpfile");
+        exit(1);
+    }
+    setvbuf(run, NULL, _IOFBF, SORT_IO_BUFFER);
+    for (size_t i = 0; i < n; i++)
+    {
+        fputs(ordered[i], run);
+    }
+    fflush(run);
+    free(ordered);
+    free(recs);
+    free(tmp);
+    return run;
+}
+
+/*
+* Close a set of run files. They come from tmpfile, so closing them
+* also removes them.
+*/
+void closeRuns(FILE **runs, int numRuns)
+{
+    for (int i = 0; i < numRuns; i++)
+    {
+        fclose(runs[i]);
+    }
+}
+
+/*
+* External sort: order a movie csv that may not fit in memory by year,
+* then rating descending, then title. Lines are collected until the memory
+* budget is used, sorted and written as a run; the runs are then combined
+* with a k-way merge, in several levels if there are more than MERGE_MAX_RUNS.
+*   ./movies --sort input.csv output.csv [memoryMB]
+*/
+int sortMode(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("You must provide an input and an output file\n");
+        printf("Example usage: ./movies --sort movies_sample_1.csv sorted.csv [memoryMB]\n");
+        return EXIT_FAILURE;
+    }
+    size_t budget = (size_t)SORT_MEMORY_MB << 20;
+    if (argc >= 3 && atoi(argv[2]) > 0)
+    {
+        budget = (size_t)atoi(argv[2]) << 20;
+    }
+
+    FILE *movieFile = fopen(argv[0], "r");
+    if (movieFile == NULL)
+    {
+        perror(argv[0]);
+        return EXIT_FAILURE;
+    }
+    setvbuf(movieFile, NULL, _IOFBF, SORT_IO_BUFFER);
+
+    // The line pointers and the line text both come out of the budget,
+    // the arena for the text gets what the pointer array leaves
+    size_t maxLines = budget / 64 + 1;
+    size_t arenaSize = budget - maxLines * sizeof(char *);
+    char **lines = malloc(maxLines * sizeof(char *));
+    char *arena = malloc(arenaSize);
+    size_t used = 0;
+    size_t n = 0;
+
+    FILE **runs = NULL;
+    int numRuns = 0;
+    char *header = NULL;
+    char *currLine = NULL;
+    size_t len = 0;
+    ssize_t nread;
+
+    while ((nread = getline(&currLine, &len, movieFile)) != -1)
+    {
+        if (header == NULL)
+        {
+            header = strdup(currLine);
+            continue;
+        }
+        // Make sure every stored line ends with a newline
+        int newline = (nread == 0 || currLine[nread - 1] != '\n');
+        size_t need = (size_t)nread + newline + 1;
+        if (used + need > arenaSize || n == maxLines)
+        {
+            runs = realloc(runs, (numRuns + 1) * sizeof(FILE *));
+            runs[numRuns++] = writeRun(lines, n);
+            used = 0;
+            n = 0;
+        }
+        if (need > arenaSize)
+        {
+            printf("A line of %s is larger than the memory budget\n", argv[0]);
+            closeRuns(runs, numRuns);
+            free(runs);
+            free(header);
+            free(currLine);
+            free(lines);
+            free(arena);
+            fclose(movieFile);
+            return EXIT_FAILURE;
+        }
+        lines[n] = arena + used;
+        memcpy(lines[n], currLine, nread);
+        if (newline)
+        {
+            lines[n][nread++] = '\n';
+        }
+        lines[n][nread] = '\0';
+        used += nread + 1;
+        n++;
+    }
+    if (n > 0 || numRuns == 0)
+    {
+        runs = realloc(runs, (numRuns + 1) * sizeof(FILE *));
+        runs[numRuns++] = writeRun(lines, n);
+    }
+    free(currLine);
+    free(lines);
+    free(arena);
+    fclose(movieFile);
+    int totalRuns = numRuns;
+
+    // Merge groups of runs into longer runs until one pass can finish
+    while (numRuns > MERGE_MAX_RUNS)
+    {
+        int merged = 0;
+        for (int i = 0; i < numRuns; i += MERGE_MAX_RUNS)
+        {
+            int k = (numRuns - i < MERGE_MAX_RUNS) ? numRuns - i : MERGE_MAX_RUNS;
+            FILE *run = tmpfile();
+            if (run == NULL)
+            {
+                perror("tmpfile");
+                closeRuns(runs, merged);
+                closeRuns(&runs[i], numRuns - i);
+                free(runs);
+                free(header);
+                return EXIT_FAILURE;
+            }
+            setvbuf(run, NULL, _IOFBF, SORT_IO_BUFFER);
+            mergeRuns(&runs[i], k, run, budget / (k + 1));
+            fflush(run);
+            runs[merged++] = run;
+        }
+        numRuns = merged;
+    }
+
+    FILE *out = fopen(argv[1], "w");
+    if (out == NULL)
+    {
+        perror(argv[1]);
+        closeRuns(runs, numRuns);
+        free(runs);
+        free(header);
+        return EXIT_FAILURE;
+    }
+    setvbuf(out, NULL, _IOFBF, SORT_IO_BUFFER);
+    if (header != NULL)
+    {
+        fputs(header, out);
+    }
+    size_t bufferSize = budget / (numRuns + 1);
+    if (bufferSize > SORT_IO_BUFFER)
+    {
+        bufferSize = SORT_IO_BUFFER;
+    }
+    mergeRuns(runs, numRuns, out, bufferSize);
+    fclose(out);
+    printf("Sorted %s into %s using %i runs\n", argv[0], argv[1], totalRuns);
+
+    free(header);
+    free(runs);
+    return EXIT_SUCCESS;
+}
+
+/*
+* Print the user instruction and read in choices
+*/
+int instructions()
+{
+    int i = 0;
+    while (i < 1 || i > 5)
+    {
+        printf("\n1. Show movies released in the specified year\n"
+                "2. Show highest rated movie for each year\n"
+                "3. Show the title and year of release of all movies in a specific language\n"
+                "4. Show all movies sorted by year, rating and title\n"
+                "5. Exit from the program\n"
+                "\nEnter a choice from 1 to 5: ");
+        scanf("%i", &i);
+
+        // only continue with integer inputs between 1 and 5
+        if (i < 1 || i > 5)
+        {
+            printf("You entered an incorrect choice. Try again.\n");
+        }
+    }
+    return i;
+}
+
+/*
+* Show movies released in a certain year
+*/
+void optionOne(struct movie *list)
+{
+    int i;
+    int temp = 0;
+
+    // User will enter a year value
+    printf("Enter the year for which you want to see movies: ");
+    scanf("%i", &i);
+    struct statTimer timer = statsBegin();
+    while (list != NULL)
+    {
+        // all movies with equivalent years will be printed
+        if (list->year == i) {
+            printTitle(list);
+            temp = 1;
+        }
+        list = list->next;
+    }
+
+    // if no movie has a matching year, print message
+    if (temp == 0)
+    {
+        outputf("No data about movies released in the year %i\n", i);
+    }
+    statsEnd(PHASE_QUERY, timer, 0);
+}
+
+/*
+* Show highest rated movie for each year
+*/
+void optionTwo(struct movie *list)
+{
+    struct statTimer timer = statsBegin();
+    decodeMovies(list);
+
+    // Create an array from years 1900 to 2021 that holds pointers to a struct
+    struct movie *highest[122];
+    for (int i = 0; i < 122; i++)
+    {
+        highest[i] = NULL;
+    }
+
+    // for every movie in the list compare rating to the same year movies
+    while (list != NULL)
+    {
+        if (highest[((list->year) - 1900)] == NULL)
+        {
+            highest[((list->year) - 1900)] = list;
+        }
+        else if (highest[((list->year) - 1900)]->rating < list->rating) {
+            highest[((list->year) - 1900)] = list;
+        }
+
+        list = list->next;
+    }
+
+    // print out every highest rating per year
+    for (int i = 0; i < 122; i++)
+    {
+        if (highest[i] != NULL)
+        {
+            outputf("%i %0.1f %s\n", highest[i]->year, highest[i]->rating, highest[i]->title);
+        }
+    }
+    statsEnd(PHASE_QUERY, timer, 0);
+}
+
+/*
+* Show movies and their year of release for a specific language
+*/
+void optionThree(struct movie *list)
+{
+    char temp_lang[21];
+    int temp = 0;
+
+    // Ask user for desired language
+    printf("Enter the language for which you want to see movies: ");
+    scanf("%s", temp_lang);
+    struct statTimer timer = statsBegin();
+    decodeMovies(list);
+
+    // For every movie, check if it has the desired langauge
+    // If language is found, print year and title of movie
+    while (list != NULL)
+    {
+        for (int i = 0; i < list->num_lang; i++)
+        {
+            if (strcmp(list->languages[i], temp_lang) == 0) {
+                outputf("%i %s\n", list->year, list->title);
+                temp = 1;
+            }
+        }
+        
+        list = list->next;
+    }
+
+    // If data does not include any movie in the language, print message
+    if (temp == 0)
+    {
+        outputf("No data about movies released in %s\n", temp_lang);
+    }
+    statsEnd(PHASE_QUERY, timer, 0);
+}
+
+/*
+* Show every movie ordered by year, then highest rating first, then title
+*/
+void optionFour(struct movie *list)
+{
+    size_t n;
+    struct statTimer timer = statsBegin();
+    decodeMovies(list);
+    struct movie **sorted = sortMovies(list, &n);
+    for (size_t i = 0; i < n; i++)
+    {
+        outputf("%i %0.1f %s\n", sorted[i]->year, sorted[i]->rating, sorted[i]->title);
+    }
+    free(sorted);
+    statsEnd(PHASE_QUERY, timer, 0);
+}
+
+/*
+*   Process the file provided as an argument to the program to
+*   create a linked list of movie structs and follow user instructions.
+*   Compile the program as follows:
+*       gcc --std=gnu99 -pthread -o movies main.c -lm
+*   Run ./movies --approx file.csv ... for approximate statistics instead,
+*   or ./movies --sort input.csv output.csv [memoryMB] to sort a file on disk.
+*   ./movies --lazy file.csv only decodes the year up front and
+*   ./movies --stats file.csv reports time and bytes per phase on exit.
+*/
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "--approx") == 0)
+    {
+        return approxMode(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--sort") == 0)
+    {
+        return sortMode(argc - 2, argv + 2);
+    }
+
+    // --lazy defers decoding everything but the year until a query needs it
+    // and --stats reports the phase counters when the program exits
+    int arg = 1;
+    int lazy = 0;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0)
+    {
+        if (strcmp(argv[arg], "--lazy") == 0)
+        {
+            lazy = 1;
+        }
+        else if (strcmp(argv[arg], "--stats") == 0)
+        {
+            statsEnabled = 1;
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[arg]);
+            return EXIT_FAILURE;
+        }
+        arg++;
+    }
+    if (arg >= argc)
+    {
+        printf("You must provide the name of the file to process\n");
+        printf("Example usage: ./movie.exe movies_sample_1.csv\n");
+        return EXIT_FAILURE;
+    }
+    struct movie *list = lazy ? processFileLazy(argv[arg]) : processFile(argv[arg]);
+    //printMovieList(list);
+    int cont = 0;
+
+    // while the program runs, print out instructions and run user choices
+    while (cont == 0)
+    {
+        int i = instructions();
+        
+        if (i == 1)
+        {
+            optionOne(list);
+        }
+
+        if (i == 2)
+        {
+            optionTwo(list);
+        }
+
         if (i == 3)
         {
             optionThree(list);
         }
 
         if (i == 4)
+        {
+            optionFour(list);
+        }
+
+        if (i == 5)
         {
             cont = 1;
         }
     }
 
-    freeMovie(list);
+    if (lazy)
+    {
+        freeLazy();
+    }
+    else
+    {
+        freeMovie(list);
+    }
+    if (statsEnabled)
+    {
+        printStats();
+    }
     return EXIT_SUCCESS;
 }
@@ -7,273 +7,3888 @@
 *  Assignment 2: Files & Directories
 */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
 #include <dirent.h>
+#include <errno.h>
+#include <ftw.h>
+#include <glob.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 
-#define PREFIX "movies_"
+#define PREFIX "movies_"
+#define FIRST_YEAR 1900
+#define NUM_YEARS 122
+#define PARTITION_MIN_BUFFER 4096
+#define PARTITION_BUFFER (64 * 1024)
+#define SORT_BUDGET (16 * 1024 * 1024)
+#define MAX_KEY_LEVELS 4
+#define MAX_KEY_LEN 256
+#define PREFIX_KEY_LEN 2
+#define RESERVED_FDS 32
+#define MAX_WORKERS 16
+#define BATCH_SIZE (256 * 1024)
+#define QUEUE_DEPTH 4
+#define RING_ENTRIES 256
+#define RING_FILES 64
+#define DENTS_BUFFER (1024 * 1024)
+#define INOTIFY_BUFFER (64 * 1024)
+#define ARCHIVE_MAGIC "MVPACK01"
+#define COPY_CHUNK (1024 * 1024)
+#define MANIFEST_NAME ".manifest"
+#define MANIFEST_MAGIC "MVMANIF1"
+#define FINGERPRINT_WINDOW 4096
+#define RATING_KEY_LEN 6
+#define CHECKSUMS_NAME ".checksums"
+#define HASH_BUFFER (1024 * 1024)
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+/* struct for movie information, the strings point into the line they were parsed from */
+struct movie {
+    char *title;
+    int year;
+    char *languages;
+    double rating;
+};
+
+/* Values that rows can be partitioned by */
+enum keyKind {
+    KEY_YEAR,
+    KEY_DECADE,
+    KEY_LANGUAGE,
+    KEY_RATING,
+    KEY_PREFIX
+};
+
+const char *keyNames[] = {"year", "decade", "language", "rating", "prefix"};
+
+/* How the output is made durable before it is renamed into place */
+enum syncMode {
+    SYNC_SYNCFS,
+    SYNC_FDATASYNC,
+    SYNC_NONE
+};
+
+const char *syncNames[] = {"syncfs", "fdatasync", "none"};
+
+/*
+*  Options given on the command line. keyLevels is the partition key, one
+*  kind per directory level with the last level naming the file, so
+*  decade/language writes 1990s/English.txt.
+*/
+struct options {
+    int keyLevels[MAX_KEY_LEVELS];
+    int numKeyLevels;
+    int maxOpen;
+    int threads;
+    int ioUring;
+    int archive;
+    int sync;
+    char *incremental;
+    char *batch;
+    int mmap;
+    int sorted;
+};
+
+struct options opts = {{KEY_YEAR}, 1, 0, 0, 0, 0, SYNC_SYNCFS, NULL, NULL, 0, 0};
+
+/* Streaming XXH64 state: four lanes over 32 byte stripes and a partial stripe */
+struct xxh64 {
+    uint64_t lanes[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t buffered;
+};
+
+/*
+*  Buffered output for one partition file. While a partition is resident
+*  it holds a buffer and possibly an open descriptor, and the buffer is
+*  written out whenever it fills up. prev and next link resident partitions
+*  from most to least recently used.
+*/
+struct partition {
+    char *key;
+    char *fileName;
+    int dirsMade;
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+    int resident;
+    struct partition *prev;
+    struct partition *next;
+    struct xxh64 hash;
+    long long rows;
+    long long bytes;
+    int pending;
+    int runs;
+};
+
+/*
+*  Output directory and a hash table of its partitions keyed by relative path.
+*  At most maxResident partitions hold a buffer or descriptor at once; the
+*  least recently used one is flushed and closed to make room for another.
+*  runSuffix is added to the file names of a batch shard that writes
+*  sorted runs to be merged later. With --sorted, buffered counts the
+*  bytes held and the partitions are spilled as runs past budget.
+*/
+struct partitionSet {
+    char dirName[256];
+    char runSuffix[16];
+    struct partition **table;
+    size_t tableSize;
+    size_t count;
+    struct partition *lruHead;
+    struct partition *lruTail;
+    int resident;
+    int maxResident;
+    long long evictions;
+    struct uring *ring;
+    int ringState;
+    struct uringFlush *flushes;
+    int numFlushes;
+    size_t buffered;
+    size_t budget;
+};
+
+/* Set once a --sorted partition set has spilled runs that need merging */
+int sortSpilled = 0;
+
+/*
+*  An io_uring instance set up with raw syscalls: the shared submission
+*  and completion rings and the submission entries, all mmapped from the
+*  ring descriptor. queued counts entries not yet handed to the kernel.
+*/
+struct uring {
+    int fd;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned sqLocalTail;
+    unsigned queued;
+};
+
+/* Operation a submission entry performs, kept in the low bits of user_data */
+enum uringOp {
+    URING_OPEN,
+    URING_WRITE,
+    URING_CLOSE,
+    URING_MKDIR
+};
+
+/* Whether a partition set has tried to set up its io_uring instance */
+enum ringState {
+    RING_UNTRIED,
+    RING_READY,
+    RING_UNAVAILABLE
+};
+
+/*
+*  A full buffer handed to io_uring while partitioning. The partition gets
+*  a new buffer, and this one is written, and the file closed if the
+*  partition was evicted, together with the other flushes of its set.
+*  fd is -1 for a file that is opened into fixed slot index + 1 first.
+*/
+struct uringFlush {
+    struct partition *part;
+    char *data;
+    size_t len;
+    size_t done;
+    int fd;
+    int close;
+    int closed;
+};
+
+/*
+*  Packed archive layout: this header, count index entries sorted by key,
+*  the key strings, then the rows of every partition back to back.
+*  All offsets are from the start of the file.
+*/
+struct archiveHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t keysOffset;
+    uint64_t dataOffset;
+};
+
+/* Where one partition's key and rows are in the archive */
+struct archiveEntry {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t keyOffset;
+    uint32_t keyLength;
+};
+
+/* A partition file found below an output directory and its size */
+struct packFile {
+    char *key;
+    off_t size;
+};
+
+struct packList {
+    struct packFile *files;
+    size_t count;
+    size_t cap;
+    size_t rootLen;
+};
+
+struct packList packFiles;
+
+/*
+*  What an incremental output directory was built from: the input file,
+*  how much of it has been partitioned, a fingerprint of its header and the
+*  bytes just before that point, and the size of every partition file once
+*  those bytes were written. Anything past the committed sizes is from a
+*  run that did not finish.
+*/
+struct manifest {
+    char input[256];
+    char key[MAX_KEY_LEN];
+    off_t size;
+    off_t processed;
+    unsigned long long fingerprint;
+    struct packList parts;
+};
+
+/* Bounded queue of pointers handed between threads */
+struct workQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    void *items[QUEUE_DEPTH];
+    int head;
+    int count;
+};
+
+/* Row count, size and XXH64 of one partition file */
+struct checksum {
+    char *key;
+    long long rows;
+    long long bytes;
+    unsigned long long hash;
+};
+
+/*
+*  Checksums of the partition files of the run in progress. With streaming
+*  set, partitions add their own as they are closed; otherwise the files
+*  are read back once they are complete.
+*/
+struct checksumList {
+    struct checksum *entries;
+    size_t count;
+    size_t cap;
+    int streaming;
+    pthread_mutex_t lock;
+};
+
+struct checksumList checksums = {NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/* Checksums to compute by reading files back, shared by the hashing threads */
+struct hashJob {
+    char *dirName;
+    struct checksum *entries;
+    size_t count;
+    size_t next;
+};
+
+/*
+*  Input files of a batch run. Parser threads take paths from the queue
+*  until they get a NULL, each into its own shard of partitions that
+*  appends to the shared output tree.
+*/
+struct batchJob {
+    struct workQueue queue;
+    char *dirName;
+    int maxOpen;
+    int count;
+    int shards;
+};
+
+/*
+*  Batch of rows for one writer, packed as the partition key, a '\0',
+*  and the line to append including its '\n'
+*/
+struct rowBatch {
+    char *data;
+    size_t len;
+};
+
+/* Worker thread that owns every partition whose key hashes to it */
+struct writer {
+    pthread_t tid;
+    struct workQueue queue;
+    struct partitionSet set;
+    struct rowBatch *pending;
+};
+
+/* What rows delivered to a pool are used for when the output is mapped */
+enum mapPass {
+    MAP_NONE,
+    MAP_COUNT,
+    MAP_COPY
+};
+
+/*
+*  Where rows are delivered: writer threads, or the pool's own partition
+*  set when numWorkers is 0. With mapPass set, rows are only counted into
+*  the set or copied into the mapped partition files.
+*/
+struct writerPool {
+    struct partitionSet set;
+    struct writer *writers;
+    int numWorkers;
+    int mapPass;
+};
+
+/*
+*  Line aligned slice of a mapped input file, parsed by one thread.
+*  Its partitions count bytes in len, then get data pointing at the
+*  chunk's place in the mapped file, cap being that offset.
+*/
+struct mapChunk {
+    pthread_t tid;
+    const char *start;
+    const char *end;
+    struct writerPool pool;
+};
+
+/* Phases reported by --stats */
+enum phase {
+    PHASE_READ,
+    PHASE_TOKENIZE,
+    PHASE_ALLOCATE,
+    PHASE_INDEX,
+    PHASE_QUERY,
+    PHASE_OUTPUT,
+    NUM_PHASES
+};
+
+const char *phaseNames[NUM_PHASES] = {"read", "tokenize", "allocate", "index build", "query", "output"};
+
+/* File system calls counted with --stats, made directly or through io_uring */
+enum sysCall {
+    CALL_OPEN,
+    CALL_WRITE,
+    CALL_CLOSE,
+    CALL_MKDIR,
+    CALL_GETDENTS,
+    CALL_FSTATAT,
+    CALL_SYNC,
+    CALL_RENAME,
+    CALL_URING_ENTER,
+    NUM_CALLS
+};
+
+const char *callNames[NUM_CALLS] = {"open", "write", "close", "mkdir", "getdents64", "fstatat", "sync",
+        "rename", "io_uring_enter"};
+
+/*
+*  Counters collected with --stats. Phases nest (buffer growth and writes
+*  happen while a row is routed), and each phase only counts the time
+*  not already counted by a phase inside it, tracked with nestedNs.
+*/
+struct phaseStats {
+    long long ns[NUM_PHASES];
+    long long bytes[NUM_PHASES];
+    long long calls[NUM_PHASES];
+    long long nestedNs;
+    long long sysCalls[NUM_CALLS];
+    long long ringOps[NUM_CALLS];
+    long long written;
+    long long evictions;
+};
+
+/* Wall time and input size of every run, with the bytes of each partition file */
+struct runStats {
+    int runs;
+    long long ns;
+    long long inputBytes;
+    struct packList partitions;
+};
+
+/* Start of a timed phase */
+struct statTimer {
+    long long start;
+    long long nested;
+};
+
+/*
+*  Every thread counts into its own stats, which worker threads add to
+*  totalStats when they finish so the hot path never takes a lock
+*/
+int statsEnabled = 0;
+__thread struct phaseStats stats;
+struct phaseStats totalStats;
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+struct runStats runTotals;
+
+/*
+* Monotonic clock in nanoseconds
+*/
+static inline long long statsClock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+* Start timing a phase. Does nothing unless --stats was given.
+*/
+static inline struct statTimer statsBegin() {
+    struct statTimer timer = {0, 0};
+    if (statsEnabled) {
+        timer.start = statsClock();
+        timer.nested = stats.nestedNs;
+    }
+    return timer;
+}
+
+/*
+* Finish timing a phase and add the bytes it handled
+*/
+static inline void statsEnd(int phase, struct statTimer timer, long long bytes) {
+    if (!statsEnabled) {
+        return;
+    }
+    long long elapsed = statsClock() - timer.start;
+    stats.ns[phase] += elapsed - (stats.nestedNs - timer.nested);
+    stats.nestedNs = timer.nested + elapsed;
+    stats.bytes[phase] += bytes;
+    stats.calls[phase]++;
+}
+
+/*
+* malloc and calloc that are counted in the allocate phase
+*/
+void *statMalloc(size_t size) {
+    struct statTimer timer = statsBegin();
+    void *ptr = malloc(size);
+    statsEnd(PHASE_ALLOCATE, timer, size);
+    return ptr;
+}
+
+void *statCalloc(size_t num, size_t size) {
+    struct statTimer timer = statsBegin();
+    void *ptr = calloc(num, size);
+    statsEnd(PHASE_ALLOCATE, timer, num * size);
+    return ptr;
+}
+
+void *statRealloc(void *old, size_t size) {
+    struct statTimer timer = statsBegin();
+    void *ptr = realloc(old, size);
+    statsEnd(PHASE_ALLOCATE, timer, size);
+    return ptr;
+}
+
+/*
+* Count one file system call. Like the phases, counts are per thread.
+*/
+static inline void countCall(int call) {
+    if (statsEnabled) {
+        stats.sysCalls[call]++;
+    }
+}
+
+/*
+* open, write, close, mkdir, fstatat and getdents64 counted for --stats
+*/
+int statOpen(const char *path, int flags, mode_t mode) {
+    countCall(CALL_OPEN);
+    return open(path, flags, mode);
+}
+
+ssize_t statWrite(int fd, const void *data, size_t len) {
+    countCall(CALL_WRITE);
+    ssize_t written = write(fd, data, len);
+    if (statsEnabled && written > 0) {
+        stats.written += written;
+    }
+    return written;
+}
+
+int statClose(int fd) {
+    countCall(CALL_CLOSE);
+    return close(fd);
+}
+
+int statMkdir(const char *path, mode_t mode) {
+    countCall(CALL_MKDIR);
+    return mkdir(path, mode);
+}
+
+int statFstatat(int dirFd, const char *path, struct stat *buf, int flags) {
+    countCall(CALL_FSTATAT);
+    return fstatat(dirFd, path, buf, flags);
+}
+
+long statGetdents(int fd, void *buffer, size_t len) {
+    countCall(CALL_GETDENTS);
+    return syscall(SYS_getdents64, fd, buffer, len);
+}
+
+/*
+* Add the counters of the calling thread to totalStats and reset them
+*/
+void mergeStats() {
+    pthread_mutex_lock(&statsLock);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        totalStats.ns[i] += stats.ns[i];
+        totalStats.bytes[i] += stats.bytes[i];
+        totalStats.calls[i] += stats.calls[i];
+    }
+    for (int i = 0; i < NUM_CALLS; i++) {
+        totalStats.sysCalls[i] += stats.sysCalls[i];
+        totalStats.ringOps[i] += stats.ringOps[i];
+    }
+    totalStats.written += stats.written;
+    totalStats.evictions += stats.evictions;
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&statsLock);
+}
+
+/*
+* qsort comparison of two pack files by key
+*/
+int comparePackFiles(const void *a, const void *b) {
+    return strcmp(((const struct packFile *)a)->key, ((const struct packFile *)b)->key);
+}
+
+/*
+* Print the counters collected with --stats to stderr
+*/
+void printStats() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    mergeStats();
+    struct phaseStats stats = totalStats;
+    fprintf(stderr, "\n%-12s %12s %14s %12s\n", "phase", "time (ms)", "bytes", "calls");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(stderr, "%-12s %12.3f %14lld %12lld\n", phaseNames[i],
+                stats.ns[i] / 1e6, stats.bytes[i], stats.calls[i]);
+    }
+    fprintf(stderr, "allocations: %lld (%lld bytes)\n", stats.calls[PHASE_ALLOCATE],
+            stats.bytes[PHASE_ALLOCATE]);
+    fprintf(stderr, "peak RSS: %ld KB\n", usage.ru_maxrss);
+
+    fprintf(stderr, "\n%-14s %12s %12s\n", "call", "syscalls", "io_uring");
+    for (int i = 0; i < NUM_CALLS; i++) {
+        fprintf(stderr, "%-14s %12lld %12lld\n", callNames[i], stats.sysCalls[i], stats.ringOps[i]);
+    }
+    fprintf(stderr, "descriptor cache evictions: %lld\n", stats.evictions);
+    double parseMs = (stats.ns[PHASE_TOKENIZE] + stats.ns[PHASE_INDEX]) / 1e6;
+    double ioMs = (stats.ns[PHASE_READ] + stats.ns[PHASE_OUTPUT]) / 1e6;
+    fprintf(stderr, "parse: %.3f ms (tokenize, index build), I/O: %.3f ms (read, output)\n", parseMs, ioMs);
+    if (runTotals.runs > 0) {
+        double seconds = runTotals.ns / 1e9;
+        double inMb = runTotals.inputBytes / 1048576.0;
+        double outMb = stats.written / 1048576.0;
+        fprintf(stderr, "runs: %d in %.3f ms, read %.2f MB (%.2f MB/s), wrote %.2f MB (%.2f MB/s)\n",
+                runTotals.runs, runTotals.ns / 1e6, inMb, (seconds > 0) ? inMb / seconds : 0,
+                outMb, (seconds > 0) ? outMb / seconds : 0);
+    }
+
+    // Bytes per partition file, added up over runs that wrote the same key
+    struct packList *parts = &runTotals.partitions;
+    qsort(parts->files, parts->count, sizeof(struct packFile), comparePackFiles);
+    if (parts->count > 0) {
+        fprintf(stderr, "\n%-24s %14s\n", "partition", "bytes");
+    }
+    for (size_t i = 0; i < parts->count; i++) {
+        long long bytes = parts->files[i].size;
+        while (i + 1 < parts->count && strcmp(parts->files[i].key, parts->files[i + 1].key) == 0) {
+            bytes += parts->files[++i].size;
+        }
+        fprintf(stderr, "%-24s %14lld\n", parts->files[i].key, bytes);
+    }
+}
+
+/* 
+*  Parse the current line which is comma delimited into a movie struct.
+*  The line is split in place and nothing is allocated.
+*  Returns 0 on success and -1 if the line has no title or year.
+*/
+int createMovie(char *currLine, struct movie *currMovie) {
+    // For use with strtok_r
+    char *saveptr;
+    currMovie->languages = "";
+    currMovie->rating = 0;
+
+    // The first token is the title
+    char *token = strtok_r(currLine, ",", &saveptr);
+    if (token == NULL) {
+        return -1;
+    }
+    currMovie->title = token;
+
+    // The next token is the year
+    token = strtok_r(NULL, ",", &saveptr);
+    if (token == NULL) {
+        return -1;
+    }
+    currMovie->year = atoi(token);
+
+    // The next token is the languages, with the '[ ]' removed
+    token = strtok_r(NULL, ",", &saveptr);
+    if (token == NULL) {
+        return 0;
+    }
+    if (token[0] == '[') {
+        token++;
+    }
+    if (strlen(token) > 0 && token[strlen(token) - 1] == ']') {
+        token[strlen(token) - 1] = '\0';
+    }
+    currMovie->languages = token;
+
+    // The last token is the rating value
+    token = strtok_r(NULL, "\n", &saveptr);
+    if (token != NULL) {
+        currMovie->rating = atof(token);
+    }
+    return 0;
+}
+
+/*
+* Parse a partition key such as "year" or "decade/language" into opts.
+* Returns 0 on success and -1 if the key is not valid.
+*/
+int parseKey(char *spec) {
+    char *copy = strdup(spec);
+    char *saveptr;
+    int levels = 0;
+    for (char *token = strtok_r(copy, "/", &saveptr); token != NULL; token = strtok_r(NULL, "/", &saveptr)) {
+        int kind = -1;
+        for (int i = 0; i < (int)(sizeof(keyNames) / sizeof(keyNames[0])); i++) {
+            if (strcmp(token, keyNames[i]) == 0) {
+                kind = i;
+            }
+        }
+        if (kind == -1 || levels == MAX_KEY_LEVELS) {
+            free(copy);
+            return -1;
+        }
+        opts.keyLevels[levels++] = kind;
+    }
+    free(copy);
+    if (levels == 0) {
+        return -1;
+    }
+    opts.numKeyLevels = levels;
+    return 0;
+}
+
+/*
+* 64 bit FNV-1a hash of a partition key
+*/
+unsigned long long hashKey(const char *key) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t lane) {
+    acc ^= xxhRound(0, lane);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/*
+* Start an XXH64 hash with seed 0
+*/
+void xxhInit(struct xxh64 *state) {
+    memset(state, 0, sizeof(struct xxh64));
+    state->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    state->lanes[1] = XXH_PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -XXH_PRIME1;
+}
+
+/*
+* Add len bytes of data to an XXH64 hash
+*/
+void xxhUpdate(struct xxh64 *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    state->total += len;
+    if (state->buffered + len < 32) {
+        memcpy(state->buffer + state->buffered, p, len);
+        state->buffered += len;
+        return;
+    }
+    if (state->buffered > 0) {
+        size_t fill = 32 - state->buffered;
+        memcpy(state->buffer + state->buffered, p, fill);
+        for (int i = 0; i < 4; i++) {
+            state->lanes[i] = xxhRound(state->lanes[i], read64(state->buffer + i * 8));
+        }
+        p += fill;
+        len -= fill;
+        state->buffered = 0;
+    }
+    uint64_t v1 = state->lanes[0], v2 = state->lanes[1], v3 = state->lanes[2], v4 = state->lanes[3];
+    while (len >= 32) {
+        v1 = xxhRound(v1, read64(p));
+        v2 = xxhRound(v2, read64(p + 8));
+        v3 = xxhRound(v3, read64(p + 16));
+        v4 = xxhRound(v4, read64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+    state->lanes[0] = v1;
+    state->lanes[1] = v2;
+    state->lanes[2] = v3;
+    state->lanes[3] = v4;
+    memcpy(state->buffer, p, len);
+    state->buffered = len;
+}
+
+/*
+* Finish an XXH64 hash, leaving the state as it was
+*/
+uint64_t xxhDigest(const struct xxh64 *state) {
+    uint64_t h;
+    if (state->total >= 32) {
+        h = rotl64(state->lanes[0], 1) + rotl64(state->lanes[1], 7) +
+            rotl64(state->lanes[2], 12) + rotl64(state->lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxhMerge(h, state->lanes[i]);
+        }
+    }
+    else {
+        h = XXH_PRIME5;
+    }
+    h += state->total;
+
+    const unsigned char *p = state->buffer;
+    size_t len = state->buffered;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxhRound(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h ^= (uint64_t)v * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= *p * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+* Number of rows in len bytes of a partition file
+*/
+long long countRows(const char *data, size_t len) {
+    long long rows = 0;
+    const char *end = data + len;
+    while ((data = memchr(data, '\n', end - data)) != NULL) {
+        rows++;
+        data++;
+    }
+    return rows;
+}
+
+/*
+* Add a checksum to the list of the run in progress
+*/
+void addChecksum(const char *key, long long rows, long long bytes, unsigned long long hash) {
+    pthread_mutex_lock(&checksums.lock);
+    if (checksums.count == checksums.cap) {
+        checksums.cap = (checksums.cap == 0) ? 256 : checksums.cap * 2;
+        checksums.entries = realloc(checksums.entries, checksums.cap * sizeof(struct checksum));
+    }
+    struct checksum *entry = &checksums.entries[checksums.count++];
+    entry->key = strdup(key);
+    entry->rows = rows;
+    entry->bytes = bytes;
+    entry->hash = hash;
+    pthread_mutex_unlock(&checksums.lock);
+}
+
+/*
+* Number of writer threads: --threads, or one per online processor.
+* A single thread writes from the main thread without a pool.
+*/
+int writerCount() {
+    int threads = opts.threads;
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > MAX_WORKERS) {
+        threads = MAX_WORKERS;
+    }
+    return (threads <= 1) ? 0 : threads;
+}
+
+/*
+* Set up an empty partition set writing into dirName
+*/
+void initPartitions(struct partitionSet *set, char *dirName, int maxResident) {
+    memset(set, 0, sizeof(struct partitionSet));
+    strncpy(set->dirName, dirName, sizeof(set->dirName) - 1);
+    set->tableSize = 256;
+    set->table = statCalloc(set->tableSize, sizeof(struct partition *));
+    set->maxResident = (maxResident < 1) ? 1 : maxResident;
+    // Sorted partitions stay in memory until they are closed or the writers'
+    // share of SORT_BUDGET is used up, when they are spilled as sorted runs
+    if (opts.sorted) {
+        int sets = writerCount();
+        set->maxResident = INT_MAX;
+        set->budget = SORT_BUDGET / ((sets == 0) ? 1 : sets);
+    }
+}
+
+/*
+* Number of partitions that may be open at once: the --max-open option,
+* or the RLIMIT_NOFILE soft limit less some descriptors kept for everything else
+*/
+int openLimit() {
+    if (opts.maxOpen > 0) {
+        return opts.maxOpen;
+    }
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY) {
+        return 1024 - RESERVED_FDS;
+    }
+    if (limit.rlim_cur <= 2 * RESERVED_FDS) {
+        return limit.rlim_cur / 2;
+    }
+    return limit.rlim_cur - RESERVED_FDS;
+}
+
+/*
+* Find the partition for a key, creating it the first time the key is seen.
+* The table uses linear probing and doubles when it is half full.
+*/
+struct partition *getPartition(struct partitionSet *set, const char *key) {
+    size_t mask = set->tableSize - 1;
+    size_t slot = hashKey(key) & mask;
+    while (set->table[slot] != NULL) {
+        if (strcmp(set->table[slot]->key, key) == 0) {
+            return set->table[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    struct partition *part = statCalloc(1, sizeof(struct partition));
+    part->key = strdup(key);
+    part->fileName = statMalloc(strlen(set->dirName) + strlen(key) + strlen(set->runSuffix) + 6);
+    sprintf(part->fileName, "%s/%s.txt%s", set->dirName, key, set->runSuffix);
+    part->fd = -1;
+    xxhInit(&part->hash);
+    set->table[slot] = part;
+    set->count++;
+
+    if (set->count * 2 > set->tableSize) {
+        struct partition **old = set->table;
+        size_t oldSize = set->tableSize;
+        set->tableSize *= 2;
+        set->table = statCalloc(set->tableSize, sizeof(struct partition *));
+        mask = set->tableSize - 1;
+        for (size_t i = 0; i < oldSize; i++) {
+            if (old[i] != NULL) {
+                slot = hashKey(old[i]->key) & mask;
+                while (set->table[slot] != NULL) {
+                    slot = (slot + 1) & mask;
+                }
+                set->table[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    return part;
+}
+
+/*
+* Create the directories above a partition file, one per key level
+*/
+void makePartitionDirs(struct partition *part) {
+    char *slash = strchr(part->fileName + 2, '/');
+    while (slash != NULL && (slash = strchr(slash + 1, '/')) != NULL) {
+        *slash = '\0';
+        if (statMkdir(part->fileName, 0750) == -1 && errno != EEXIST) {
+            printf("mkdir() failed on \"%s\"\n", part->fileName);
+            perror("Error");
+            exit(1);
+        }
+        *slash = '/';
+    }
+    part->dirsMade = 1;
+}
+
+/*
+* Open the file of a partition for appending if it is not open yet
+*/
+void openPartition(struct partition *part) {
+    if (part->fd != -1) {
+        return;
+    }
+    if (!part->dirsMade) {
+        makePartitionDirs(part);
+    }
+    // The file is created with rw-r----- permissions
+    part->fd = statOpen(part->fileName, O_WRONLY | O_CREAT | O_APPEND, 0640);
+    if (part->fd == -1) {
+        printf("open() failed on \"%s\"\n", part->fileName);
+        perror("Error");
+        exit(1);
+    }
+}
+
+/*
+* Add bytes written to a partition file to its checksum
+*/
+void hashPartition(struct partition *part, const char *data, size_t len) {
+    if (checksums.streaming) {
+        xxhUpdate(&part->hash, data, len);
+        part->rows += countRows(data, len);
+        part->bytes += len;
+    }
+}
+
+/*
+* Write all len bytes of data to fd, retrying short writes.
+* Returns 0 on success and -1 on error.
+*/
+int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = statWrite(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/*
+* Write data straight to the file of a partition
+*/
+void writePartition(struct partition *part, const char *data, size_t len) {
+    struct statTimer timer = statsBegin();
+    openPartition(part);
+    if (writeAll(part->fd, data, len) == -1) {
+        printf("write() failed on \"%s\"\n", part->fileName);
+        perror("Error");
+        exit(1);
+    }
+    hashPartition(part, data, len);
+    statsEnd(PHASE_OUTPUT, timer, len);
+}
+
+/*
+* Write out the buffered contents of a partition and empty the buffer
+*/
+void flushPartition(struct partition *part) {
+    if (part->len > 0) {
+        writePartition(part, part->data, part->len);
+        part->len = 0;
+    }
+}
+
+/*
+* Release the rings and descriptor of an io_uring instance
+*/
+void uringClose(struct uring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    close(ring->fd);
+}
+
+/*
+* Check that the kernel supports every operation the batched writer uses
+*/
+int uringProbe(struct uring *ring) {
+    int ops[] = {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_MKDIRAT};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; ok && i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            ok = 0;
+        }
+    }
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+/*
+* Set up an io_uring instance with a table of RING_FILES empty fixed file
+* slots for direct descriptors. Returns 0 on success and -1 if io_uring or
+* one of the operations is not available, in which case the caller falls
+* back to plain syscalls.
+*/
+int uringSetup(struct uring *ring) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    }
+    else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uringClose(ring);
+        return -1;
+    }
+
+    char *sq = ring->sqRing;
+    char *cq = ring->cqRing;
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sqLocalTail = *ring->sqTail;
+
+    // Register an empty file table so files can be opened into fixed slots
+    int fds[RING_FILES];
+    for (int i = 0; i < RING_FILES; i++) {
+        fds[i] = -1;
+    }
+    if (uringProbe(ring) == -1 ||
+            syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, RING_FILES) == -1) {
+        uringClose(ring);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* Get the next free submission entry, cleared, tagged with an operation
+* and the index of the item it belongs to
+*/
+struct io_uring_sqe *uringGetSqe(struct uring *ring, int op, size_t index) {
+    unsigned slot = ring->sqLocalTail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (index << 2) | op;
+    ring->sqArray[slot] = slot;
+    ring->sqLocalTail++;
+    ring->queued++;
+    return sqe;
+}
+
+/*
+* Submit every queued entry and wait for all of their completions, calling
+* handle with the result of each. Entries cancelled because an earlier
+* entry of their link failed complete with -ECANCELED.
+*/
+void uringSubmitAndWait(struct uring *ring, void (*handle)(void *, int, size_t, int), void *arg) {
+    unsigned remaining = ring->queued;
+    unsigned toSubmit = ring->queued;
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    while (remaining > 0) {
+        countCall(CALL_URING_ENTER);
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter");
+            exit(1);
+        }
+        toSubmit -= submitted;
+
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            handle(arg, cqe->user_data & 3, cqe->user_data >> 2, cqe->res);
+            head++;
+            remaining--;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+* Whether an io_uring result means the kernel does not support what was asked,
+* so the work is done with plain syscalls instead
+*/
+int uringUnsupported(int res) {
+    return res == -ENOSYS || res == -EINVAL || res == -EOPNOTSUPP;
+}
+
+/*
+* Set up the io_uring instance of a partition set the first time it is
+* needed. Returns 0 if the set can use io_uring and -1 if it falls back
+* to plain syscalls.
+*/
+int setRing(struct partitionSet *set) {
+    static int warned = 0;
+    if (set->ringState == RING_UNTRIED) {
+        set->ring = malloc(sizeof(struct uring));
+        if (uringSetup(set->ring) == -1) {
+            free(set->ring);
+            set->ring = NULL;
+            set->ringState = RING_UNAVAILABLE;
+            if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+                fprintf(stderr, "io_uring is not available, using synchronous I/O\n");
+            }
+        }
+        else {
+            set->ringState = RING_READY;
+            set->flushes = malloc(RING_FILES * sizeof(struct uringFlush));
+        }
+    }
+    return (set->ringState == RING_READY) ? 0 : -1;
+}
+
+/*
+* Apply the result of one completed operation to its queued flush.
+* Real I/O errors end the program like the synchronous path does.
+*/
+void flushHandle(void *arg, int op, size_t index, int res) {
+    struct partitionSet *set = arg;
+    struct uringFlush *flush = &set->flushes[index];
+    if (uringUnsupported(res)) {
+        set->ringState = RING_UNAVAILABLE;
+        return;
+    }
+    if (res < 0 && res != -ECANCELED) {
+        printf("%s() failed on \"%s\"\n", (op == URING_OPEN) ? "open" : (op == URING_WRITE) ? "write" : "close",
+                flush->part->fileName);
+        errno = -res;
+        perror("Error");
+        exit(1);
+    }
+    if (statsEnabled && res >= 0) {
+        int calls[] = {CALL_OPEN, CALL_WRITE, CALL_CLOSE, CALL_MKDIR};
+        stats.ringOps[calls[op]]++;
+        stats.written += (op == URING_WRITE) ? res : 0;
+    }
+    if (op == URING_WRITE && res > 0) {
+        hashPartition(flush->part, flush->data + flush->done, res);
+        flush->done += res;
+    }
+    else if (op == URING_CLOSE && res == 0) {
+        flush->closed = 1;
+    }
+}
+
+/*
+* Write every queued flush of a set with one io_uring_enter. Each flush is
+* a linked chain: an open into a fixed slot if the file is not open, the
+* write and a close if the partition was evicted. Whatever a short write,
+* cancelled link or refused operation left undone is finished with plain
+* syscalls, so the data always reaches the file in order.
+*/
+void submitFlushes(struct partitionSet *set) {
+    if (set->numFlushes == 0) {
+        return;
+    }
+    struct statTimer timer = statsBegin();
+    long long bytes = 0;
+    for (int n = 0; n < set->numFlushes; n++) {
+        struct uringFlush *flush = &set->flushes[n];
+        struct io_uring_sqe *sqe;
+        bytes += flush->len;
+        if (flush->fd == -1) {
+            sqe = uringGetSqe(set->ring, URING_OPEN, n);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)flush->part->fileName;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_APPEND;
+            sqe->len = 0640;
+            sqe->file_index = n + 1;
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        sqe = uringGetSqe(set->ring, URING_WRITE, n);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = (flush->fd == -1) ? n : flush->fd;
+        sqe->addr = (unsigned long)flush->data;
+        sqe->len = flush->len;
+        sqe->off = -1;
+        sqe->flags = (flush->fd == -1) ? IOSQE_FIXED_FILE : 0;
+        if (flush->close) {
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe = uringGetSqe(set->ring, URING_CLOSE, n);
+            sqe->opcode = IORING_OP_CLOSE;
+            if (flush->fd == -1) {
+                sqe->file_index = n + 1;
+            }
+            else {
+                sqe->fd = flush->fd;
+            }
+        }
+    }
+    uringSubmitAndWait(set->ring, flushHandle, set);
+
+    for (int n = 0; n < set->numFlushes; n++) {
+        struct uringFlush *flush = &set->flushes[n];
+        struct partition *part = flush->part;
+        if (flush->done < flush->len) {
+            int fd = flush->fd;
+            if (fd == -1) {
+                fd = statOpen(part->fileName, O_WRONLY | O_CREAT | O_APPEND, 0640);
+            }
+            if (fd == -1 || writeAll(fd, flush->data + flush->done, flush->len - flush->done) == -1) {
+                printf("%s() failed on \"%s\"\n", (fd == -1) ? "open" : "write", part->fileName);
+                perror("Error");
+                exit(1);
+            }
+            hashPartition(part, flush->data + flush->done, flush->len - flush->done);
+            if (flush->fd == -1 && fd != part->fd) {
+                statClose(fd);
+            }
+        }
+        if (flush->close && !flush->closed && flush->fd != -1) {
+            statClose(flush->fd);
+        }
+        part->pending = 0;
+        free(flush->data);
+    }
+    set->numFlushes = 0;
+    statsEnd(PHASE_OUTPUT, timer, bytes);
+}
+
+/*
+* Hand the buffer of a partition to the set's io_uring batch instead of
+* writing it now, closing the file as well when the partition is evicted.
+* The batch is submitted first if it is full or already holds a flush of
+* this partition, so writes to a file stay in order. Without io_uring the
+* buffer is written straight away.
+*/
+void queueFlush(struct partitionSet *set, struct partition *part, int close) {
+    if (part->len == 0 || !opts.ioUring || setRing(set) == -1) {
+        flushPartition(part);
+        if (close && part->fd != -1) {
+            statClose(part->fd);
+            part->fd = -1;
+        }
+        return;
+    }
+    if (part->pending || set->numFlushes == RING_FILES) {
+        submitFlushes(set);
+        if (set->ringState != RING_READY) {
+            queueFlush(set, part, close);
+            return;
+        }
+    }
+    if (part->fd == -1 && !close) {
+        openPartition(part);
+    }
+    else if (!part->dirsMade) {
+        makePartitionDirs(part);
+    }
+
+    struct uringFlush *flush = &set->flushes[set->numFlushes++];
+    flush->part = part;
+    flush->data = part->data;
+    flush->len = part->len;
+    flush->done = 0;
+    flush->fd = part->fd;
+    flush->close = close;
+    flush->closed = 0;
+    part->pending = 1;
+    part->data = close ? NULL : statMalloc(part->cap);
+    part->cap = close ? 0 : part->cap;
+    part->len = 0;
+    if (close) {
+        part->fd = -1;
+    }
+}
+
+/*
+* qsort comparison of two rows by their rating key, then title
+*/
+int compareRows(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+* Sort the rows buffered for a partition by rating, highest first, then
+* title. Every row starts with a rating key that sorts that way as text;
+* it is dropped unless keepKeys is set for runs that are merged later.
+*/
+void sortPartition(struct partition *part, int keepKeys) {
+    if (part->len == 0) {
+        return;
+    }
+    struct statTimer timer = statsBegin();
+    size_t numRows = 0;
+    for (char *row = part->data; row < part->data + part->len; row = strchr(row, '\n') + 1) {
+        numRows++;
+    }
+    char **rows = statMalloc(numRows * sizeof(char *));
+    char *row = part->data;
+    for (size_t i = 0; i < numRows; i++) {
+        char *newline = memchr(row, '\n', part->data + part->len - row);
+        *newline = '\0';
+        rows[i] = row;
+        row = newline + 1;
+    }
+    qsort(rows, numRows, sizeof(char *), compareRows);
+
+    size_t skip = keepKeys ? 0 : RATING_KEY_LEN;
+    char *sorted = statMalloc(part->len);
+    size_t len = 0;
+    for (size_t i = 0; i < numRows; i++) {
+        size_t rowLen = strlen(rows[i]) - skip;
+        memcpy(sorted + len, rows[i] + skip, rowLen);
+        len += rowLen;
+        sorted[len++] = '\n';
+    }
+    free(rows);
+    free(part->data);
+    part->data = sorted;
+    part->cap = part->len;
+    part->len = len;
+    statsEnd(PHASE_INDEX, timer, len);
+}
+
+/*
+* Sort the rows buffered for a partition of a --sorted set and write them,
+* rating keys kept, to a run file of their own next to the partition file.
+* The runs are merged into the partition file by mergeSortedRuns.
+*/
+void spillPartition(struct partitionSet *set, struct partition *part) {
+    if (part->len == 0) {
+        return;
+    }
+    sortPartition(part, 1);
+    char path[strlen(part->fileName) + 32];
+    // Batch shard files already end in .runN, their spills get another number
+    snprintf(path, sizeof(path), (set->runSuffix[0] == '\0') ? "%s.run%d" : "%s.%d", part->fileName, part->runs);
+    if (!part->dirsMade) {
+        makePartitionDirs(part);
+    }
+    struct statTimer timer = statsBegin();
+    int fd = statOpen(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd == -1 || writeAll(fd, part->data, part->len) == -1) {
+        printf("write() failed on \"%s\"\n", path);
+        perror("Error");
+        exit(1);
+    }
+    statClose(fd);
+    statsEnd(PHASE_OUTPUT, timer, part->len);
+    free(part->data);
+    part->data = NULL;
+    part->len = 0;
+    part->cap = 0;
+    part->runs++;
+    __atomic_store_n(&sortSpilled, 1, __ATOMIC_RELAXED);
+}
+
+/*
+* Spill every partition of a --sorted set as a sorted run, once the set
+* buffers more than its share of SORT_BUDGET
+*/
+void spillRuns(struct partitionSet *set) {
+    for (size_t i = 0; i < set->tableSize; i++) {
+        if (set->table[i] != NULL) {
+            spillPartition(set, set->table[i]);
+        }
+    }
+    set->buffered = 0;
+}
+
+/*
+* Append text to the buffer of a partition of set. The buffer grows up to
+* PARTITION_BUFFER and is flushed to the file when it would overflow,
+* through the set's io_uring batch with --io-uring.
+*/
+void appendPartition(struct partitionSet *set, struct partition *part, const char *text, size_t len) {
+    if (part->len + len > PARTITION_BUFFER && !opts.sorted) {
+        queueFlush(set, part, 0);
+        if (len > PARTITION_BUFFER) {
+            if (part->pending) {
+                submitFlushes(set);
+            }
+            writePartition(part, text, len);
+            return;
+        }
+    }
+    if (part->len + len > part->cap) {
+        size_t cap = (part->cap == 0) ? PARTITION_MIN_BUFFER : part->cap;
+        while (part->len + len > cap) {
+            cap *= 2;
+        }
+        part->data = statRealloc(part->data, cap);
+        part->cap = cap;
+    }
+    memcpy(part->data + part->len, text, len);
+    part->len += len;
+    if (opts.sorted) {
+        set->buffered += len;
+    }
+}
+
+/*
+* Remove a resident partition from the LRU list
+*/
+void unlinkPartition(struct partitionSet *set, struct partition *part) {
+    if (part->prev != NULL) {
+        part->prev->next = part->next;
+    }
+    else {
+        set->lruHead = part->next;
+    }
+    if (part->next != NULL) {
+        part->next->prev = part->prev;
+    }
+    else {
+        set->lruTail = part->prev;
+    }
+    part->prev = NULL;
+    part->next = NULL;
+}
+
+/*
+* Flush a partition, close its file and free its buffer so it no
+* longer counts against the limit. It is reopened for appending if
+* more rows arrive later. With --io-uring the write and close join
+* the set's next batch.
+*/
+void evictPartition(struct partitionSet *set, struct partition *part) {
+    queueFlush(set, part, 1);
+    if (part->fd != -1) {
+        statClose(part->fd);
+        part->fd = -1;
+    }
+    free(part->data);
+    part->data = NULL;
+    part->cap = 0;
+    unlinkPartition(set, part);
+    part->resident = 0;
+    set->resident--;
+    set->evictions++;
+}
+
+/*
+* Mark a partition as the most recently used, making it resident and
+* evicting the least recently used partition first if the set is full.
+* A --sorted set over its budget spills its runs here, between rows.
+*/
+void touchPartition(struct partitionSet *set, struct partition *part) {
+    if (opts.sorted && set->buffered > set->budget) {
+        spillRuns(set);
+    }
+    if (set->lruHead == part) {
+        return;
+    }
+    if (part->resident) {
+        unlinkPartition(set, part);
+    }
+    else {
+        if (set->resident == set->maxResident) {
+            evictPartition(set, set->lruTail);
+        }
+        part->resident = 1;
+        set->resident++;
+    }
+    part->next = set->lruHead;
+    if (set->lruHead != NULL) {
+        set->lruHead->prev = part;
+    }
+    set->lruHead = part;
+    if (set->lruTail == NULL) {
+        set->lruTail = part;
+    }
+}
+
+/* Partitions in one io_uring batch and whether the kernel refused an operation */
+struct uringBatch {
+    struct partition **parts;
+    char **dirs;
+    int unsupported;
+};
+
+/*
+* Apply the result of one completed operation to its partition or directory.
+* Real I/O errors end the program like the synchronous path does.
+*/
+void uringHandle(void *arg, int op, size_t index, int res) {
+    struct uringBatch *batch = arg;
+    if (uringUnsupported(res)) {
+        batch->unsupported = 1;
+        return;
+    }
+    if (op == URING_MKDIR) {
+        if (statsEnabled) {
+            stats.ringOps[CALL_MKDIR]++;
+        }
+        if (res < 0 && res != -EEXIST) {
+            printf("mkdir() failed on \"%s\"\n", batch->dirs[index]);
+            errno = -res;
+            perror("Error");
+            exit(1);
+        }
+        return;
+    }
+
+    if (statsEnabled && res >= 0) {
+        int calls[] = {CALL_OPEN, CALL_WRITE, CALL_CLOSE, CALL_MKDIR};
+        stats.ringOps[calls[op]]++;
+        stats.written += (op == URING_WRITE) ? res : 0;
+    }
+    struct partition *part = batch->parts[index];
+    if (res < 0 && res != -ECANCELED) {
+        printf("%s() failed on \"%s\"\n", (op == URING_OPEN) ? "open" : (op == URING_WRITE) ? "write" : "close",
+                part->fileName);
+        errno = -res;
+        perror("Error");
+        exit(1);
+    }
+    if (op == URING_WRITE && res > 0) {
+        // Keep whatever a short write left for the synchronous path
+        hashPartition(part, part->data, res);
+        memmove(part->data, part->data + res, part->len - res);
+        part->len -= res;
+    }
+    else if (op == URING_CLOSE && res == 0) {
+        part->fd = -1;
+    }
+}
+
+/*
+* Number of '/' in a path, which orders parents before their children
+*/
+int dirDepth(const char *path) {
+    int depth = 0;
+    for (; *path; path++) {
+        depth += (*path == '/');
+    }
+    return depth;
+}
+
+/*
+* Compare directory paths by depth and then by name
+*/
+int compareDirs(const void *a, const void *b) {
+    const char *x = *(char *const *)a;
+    const char *y = *(char *const *)b;
+    int depthX = dirDepth(x);
+    int depthY = dirDepth(y);
+    return (depthX != depthY) ? depthX - depthY : strcmp(x, y);
+}
+
+/*
+* Create the directories of every partition of the set with MKDIRAT,
+* one batch per directory depth so parents exist before their children.
+* Returns 0 on success and -1 if the kernel refused the operation.
+*/
+int uringMakeDirs(struct uring *ring, struct partitionSet *set) {
+    size_t numDirs = 0;
+    size_t capDirs = 64;
+    char **dirs = malloc(capDirs * sizeof(char *));
+    for (size_t i = 0; i < set->tableSize; i++) {
+        struct partition *part = set->table[i];
+        if (part == NULL || part->dirsMade || part->len == 0) {
+            continue;
+        }
+        char *slash = strchr(part->fileName + 2, '/');
+        while (slash != NULL && (slash = strchr(slash + 1, '/')) != NULL) {
+            if (numDirs == capDirs) {
+                capDirs *= 2;
+                dirs = realloc(dirs, capDirs * sizeof(char *));
+            }
+            dirs[numDirs++] = strndup(part->fileName, slash - part->fileName);
+        }
+    }
+
+    // Sort parents first and drop duplicates
+    qsort(dirs, numDirs, sizeof(char *), compareDirs);
+    size_t unique = 0;
+    for (size_t i = 0; i < numDirs; i++) {
+        if (unique > 0 && strcmp(dirs[unique - 1], dirs[i]) == 0) {
+            free(dirs[i]);
+        }
+        else {
+            dirs[unique++] = dirs[i];
+        }
+    }
+
+    struct uringBatch batch = {NULL, dirs, 0};
+    size_t i = 0;
+    while (i < unique && !batch.unsupported) {
+        int depth = dirDepth(dirs[i]);
+        while (i < unique && dirDepth(dirs[i]) == depth && ring->queued < RING_ENTRIES) {
+            struct io_uring_sqe *sqe = uringGetSqe(ring, URING_MKDIR, i);
+            sqe->opcode = IORING_OP_MKDIRAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)dirs[i];
+            sqe->len = 0750;
+            i++;
+        }
+        uringSubmitAndWait(ring, uringHandle, &batch);
+    }
+
+    for (size_t j = 0; j < unique; j++) {
+        free(dirs[j]);
+    }
+    free(dirs);
+    if (batch.unsupported) {
+        return -1;
+    }
+    for (size_t j = 0; j < set->tableSize; j++) {
+        if (set->table[j] != NULL && set->table[j]->len > 0) {
+            set->table[j]->dirsMade = 1;
+        }
+    }
+    return 0;
+}
+
+/*
+* Flush and close every partition of the set through io_uring. Each file
+* is a chain of linked entries: an open into a fixed file slot, a write of
+* the whole buffer and a close, so up to RING_FILES files cost a single
+* io_uring_enter. Files that are already open only get a write and a close.
+* Whatever could not be done this way is left for the synchronous path.
+*/
+void flushPartitionsUring(struct partitionSet *set) {
+    if (setRing(set) == -1) {
+        return;
+    }
+    struct uring *ring = set->ring;
+    struct statTimer timer = statsBegin();
+    long long bytes = 0;
+
+    if (uringMakeDirs(ring, set) == -1) {
+        return;
+    }
+
+    struct partition *parts[RING_FILES];
+    struct uringBatch batch = {parts, NULL, 0};
+    size_t i = 0;
+    while (i < set->tableSize && !batch.unsupported) {
+        int n = 0;
+        for (; i < set->tableSize && n < RING_FILES; i++) {
+            struct partition *part = set->table[i];
+            if (part == NULL || (part->len == 0 && part->fd == -1)) {
+                continue;
+            }
+            parts[n] = part;
+            bytes += part->len;
+            if (part->fd == -1) {
+                struct io_uring_sqe *sqe = uringGetSqe(ring, URING_OPEN, n);
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (unsigned long)part->fileName;
+                sqe->open_flags = O_WRONLY | O_CREAT | O_APPEND;
+                sqe->len = 0640;
+                sqe->file_index = n + 1;
+                sqe->flags = IOSQE_IO_LINK;
+
+                sqe = uringGetSqe(ring, URING_WRITE, n);
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = n;
+                sqe->addr = (unsigned long)part->data;
+                sqe->len = part->len;
+                sqe->off = -1;
+                sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+                sqe = uringGetSqe(ring, URING_CLOSE, n);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->file_index = n + 1;
+            }
+            else {
+                struct io_uring_sqe *sqe;
+                if (part->len > 0) {
+                    sqe = uringGetSqe(ring, URING_WRITE, n);
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->fd = part->fd;
+                    sqe->addr = (unsigned long)part->data;
+                    sqe->len = part->len;
+                    sqe->off = -1;
+                    sqe->flags = IOSQE_IO_LINK;
+                }
+                sqe = uringGetSqe(ring, URING_CLOSE, n);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = part->fd;
+            }
+            n++;
+        }
+        if (n > 0) {
+            uringSubmitAndWait(ring, uringHandle, &batch);
+        }
+    }
+    statsEnd(PHASE_OUTPUT, timer, bytes);
+}
+
+/*
+* Flush and close every partition and free the set. With --io-uring the
+* files are written in batches first and the loop only finishes anything
+* the batches left behind. With --sorted each partition is sorted first,
+* by the thread that owns it, or spilled as a last run if it already has some.
+*/
+void closePartitions(struct partitionSet *set) {
+    for (size_t i = 0; opts.sorted && i < set->tableSize; i++) {
+        struct partition *part = set->table[i];
+        // The rest of a partition that has spilled runs is one more run
+        if (part != NULL && part->runs > 0) {
+            spillPartition(set, part);
+        }
+        else if (part != NULL) {
+            sortPartition(part, set->runSuffix[0] != '\0');
+        }
+    }
+    if (opts.ioUring) {
+        if (set->ringState == RING_READY) {
+            submitFlushes(set);
+        }
+        flushPartitionsUring(set);
+    }
+    for (size_t i = 0; i < set->tableSize; i++) {
+        struct partition *part = set->table[i];
+        if (part == NULL) {
+            continue;
+        }
+        flushPartition(part);
+        if (part->fd != -1) {
+            statClose(part->fd);
+        }
+        if (checksums.streaming && set->runSuffix[0] == '\0') {
+            addChecksum(part->key, part->rows, part->bytes, xxhDigest(&part->hash));
+        }
+        free(part->data);
+        free(part->fileName);
+        free(part->key);
+        free(part);
+    }
+    free(set->table);
+    stats.evictions += set->evictions;
+    if (set->ring != NULL) {
+        uringClose(set->ring);
+        free(set->ring);
+        free(set->flushes);
+    }
+}
+
+/*
+* Initialize an empty queue
+*/
+void initQueue(struct workQueue *queue) {
+    memset(queue, 0, sizeof(struct workQueue));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+}
+
+/*
+* Add an item to the queue, waiting while it is full
+*/
+void pushQueue(struct workQueue *queue, void *item) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == QUEUE_DEPTH) {
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count) % QUEUE_DEPTH] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+* Take the oldest item from the queue, waiting while it is empty
+*/
+void *popQueue(struct workQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+    void *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % QUEUE_DEPTH;
+    queue->count--;
+    pthread_cond_signal(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+/*
+* Append a line to a partition of set, making it the most recently used
+*/
+void appendRow(struct partitionSet *set, const char *key, const char *line, size_t len) {
+    struct partition *part = getPartition(set, key);
+    touchPartition(set, part);
+    appendPartition(set, part, line, len);
+}
+
+/*
+* Writer thread: append every row of every batch to the partitions it owns
+* until it receives NULL, then flush and close them
+*/
+void *writerMain(void *arg) {
+    struct writer *w = arg;
+    struct rowBatch *batch;
+    while ((batch = popQueue(&w->queue)) != NULL) {
+        char *row = batch->data;
+        char *end = batch->data + batch->len;
+        while (row < end) {
+            char *line = row + strlen(row) + 1;
+            char *newline = memchr(line, '\n', end - line);
+            appendRow(&w->set, row, line, newline - line + 1);
+            row = newline + 1;
+        }
+        free(batch->data);
+        free(batch);
+    }
+    closePartitions(&w->set);
+    mergeStats();
+    return NULL;
+}
+
+/*
+* Hand a writer its pending batch and start a new one
+*/
+void sendBatch(struct writer *w) {
+    pushQueue(&w->queue, w->pending);
+    w->pending = statMalloc(sizeof(struct rowBatch));
+    w->pending->data = statMalloc(BATCH_SIZE);
+    w->pending->len = 0;
+}
+
+/*
+* Add the title of a movie to the partition with the given key. Without
+* workers it is appended right away, otherwise it is batched for the
+* writer that owns the key.
+*/
+void deliverRow(struct writerPool *pool, const char *key, const char *title) {
+    size_t titleLen = strlen(title);
+    if (pool->mapPass != MAP_NONE) {
+        struct partition *part = getPartition(&pool->set, key);
+        if (pool->mapPass == MAP_COPY) {
+            memcpy(part->data + part->len, title, titleLen);
+            part->data[part->len + titleLen] = '\n';
+        }
+        part->len += titleLen + 1;
+        return;
+    }
+    if (pool->numWorkers == 0) {
+        struct partition *part = getPartition(&pool->set, key);
+        touchPartition(&pool->set, part);
+        appendPartition(&pool->set, part, title, titleLen);
+        appendPartition(&pool->set, part, "\n", 1);
+        return;
+    }
+
+    struct writer *w = &pool->writers[hashKey(key) % pool->numWorkers];
+    size_t keyLen = strlen(key);
+    if (w->pending->len + keyLen + titleLen + 2 > BATCH_SIZE) {
+        sendBatch(w);
+    }
+    if (keyLen + titleLen + 2 > BATCH_SIZE) {
+        // A row larger than a batch gets a batch of its own
+        w->pending->data = statRealloc(w->pending->data, keyLen + titleLen + 2);
+    }
+    char *row = w->pending->data + w->pending->len;
+    memcpy(row, key, keyLen + 1);
+    memcpy(row + keyLen + 1, title, titleLen);
+    row[keyLen + 1 + titleLen] = '\n';
+    w->pending->len += keyLen + titleLen + 2;
+}
+
+/*
+* Start the writers of a pool, splitting the open file limit between them
+*/
+void startWriters(struct writerPool *pool, char *dirName) {
+    memset(pool, 0, sizeof(struct writerPool));
+    pool->numWorkers = writerCount();
+    if (pool->numWorkers == 0) {
+        initPartitions(&pool->set, dirName, openLimit());
+        return;
+    }
+    pool->writers = statCalloc(pool->numWorkers, sizeof(struct writer));
+    for (int i = 0; i < pool->numWorkers; i++) {
+        struct writer *w = &pool->writers[i];
+        initQueue(&w->queue);
+        initPartitions(&w->set, dirName, openLimit() / pool->numWorkers);
+        w->pending = statMalloc(sizeof(struct rowBatch));
+        w->pending->data = statMalloc(BATCH_SIZE);
+        w->pending->len = 0;
+        pthread_create(&w->tid, NULL, writerMain, w);
+    }
+}
+
+/*
+* Send the last batches, wait for every writer to finish and free the pool
+*/
+void stopWriters(struct writerPool *pool) {
+    if (pool->numWorkers == 0) {
+        closePartitions(&pool->set);
+        return;
+    }
+    for (int i = 0; i < pool->numWorkers; i++) {
+        struct writer *w = &pool->writers[i];
+        pushQueue(&w->queue, w->pending);
+        pushQueue(&w->queue, NULL);
+    }
+    for (int i = 0; i < pool->numWorkers; i++) {
+        pthread_join(pool->writers[i].tid, NULL);
+    }
+    free(pool->writers);
+}
+
+/*
+* Write the value of one key level into buf so it can be used as a file or
+* directory name, replacing characters that are not allowed in names.
+* For the language level, value is the language to use.
+*/
+void keyValue(char *buf, size_t size, int kind, struct movie *aMovie, const char *value) {
+    switch (kind) {
+        case KEY_YEAR:
+            snprintf(buf, size, "%i", aMovie->year);
+            break;
+        case KEY_DECADE:
+            snprintf(buf, size, "%is", aMovie->year - aMovie->year % 10);
+            break;
+        case KEY_RATING:
+            snprintf(buf, size, "%i.x", (int)aMovie->rating);
+            break;
+        case KEY_PREFIX:
+            snprintf(buf, size, "%.*s", PREFIX_KEY_LEN, aMovie->title);
+            for (char *c = buf; *c; c++) {
+                if (*c == '/' || *c == '.') {
+                    *c = '_';
+                }
+            }
+            break;
+        case KEY_LANGUAGE:
+            snprintf(buf, size, "%s", value);
+            for (char *c = buf; *c; c++) {
+                if (*c == '/' || (c == buf && *c == '.')) {
+                    *c = '_';
+                }
+            }
+            break;
+    }
+}
+
+/*
+* Build the key of every partition a movie belongs to, one level at a time,
+* and append the title to each. The language level fans out to one
+* partition per language of the movie.
+*/
+void routeLevel(struct writerPool *pool, struct movie *aMovie, const char *row, int level, char *key, size_t keyLen) {
+    if (level == opts.numKeyLevels) {
+        deliverRow(pool, key, row);
+        return;
+    }
+    // A key with no room left for the '/' and one more character is not
+    // routed, so keyValue is never given a size of 0 and key stays terminated
+    if (level > 0 && keyLen + 2 > MAX_KEY_LEN) {
+        return;
+    }
+    if (level > 0) {
+        key[keyLen++] = '/';
+    }
+
+    int kind = opts.keyLevels[level];
+    if (kind != KEY_LANGUAGE) {
+        keyValue(key + keyLen, MAX_KEY_LEN - keyLen, kind, aMovie, NULL);
+        routeLevel(pool, aMovie, row, level + 1, key, keyLen + strlen(key + keyLen));
+        return;
+    }
+
+    // Copy the language list so each language can be split off in turn
+    char languages[MAX_KEY_LEN];
+    char *saveptr;
+    snprintf(languages, sizeof(languages), "%s", aMovie->languages);
+    for (char *lang = strtok_r(languages, ";", &saveptr); lang != NULL; lang = strtok_r(NULL, ";", &saveptr)) {
+        keyValue(key + keyLen, MAX_KEY_LEN - keyLen, kind, aMovie, lang);
+        routeLevel(pool, aMovie, row, level + 1, key, keyLen + strlen(key + keyLen));
+    }
+}
+
+/*
+* Append a movie to every partition it belongs to. Years outside
+* 1900 to 2021 do not get a file.
+*/
+void routeMovie(struct writerPool *pool, struct movie *aMovie) {
+    if (aMovie->year < FIRST_YEAR || aMovie->year >= FIRST_YEAR + NUM_YEARS) {
+        return;
+    }
+    char key[MAX_KEY_LEN + 1];
+    key[0] = '\0';
+    if (!opts.sorted) {
+        routeLevel(pool, aMovie, aMovie->title, 0, key, 0);
+        return;
+    }
+
+    // Prefix the title with 10 - rating in thousandths so rows sort as text
+    char row[RATING_KEY_LEN + strlen(aMovie->title) + 1];
+    long ratingKey = (long)((10.0 - aMovie->rating) * 1000 + 0.5);
+    ratingKey = (ratingKey < 0) ? 0 : (ratingKey > 99999) ? 99999 : ratingKey;
+    sprintf(row, "%05ld\t%s", ratingKey, aMovie->title);
+    routeLevel(pool, aMovie, row, 0, key, 0);
+}
+
+/*
+* Stream the specified file line by line into the partitions.
+* Each row is parsed and appended to its year's buffer right away, so
+* memory use depends on the number of partitions and not the file size.
+* Rows start at byte start, after the header. If processed is given, a
+* last line without a newline is left for later and processed is set to
+* the offset after the last complete line.
+* Returns the number of movies processed.
+*/
+int processFile(char *filePath, struct writerPool *pool, off_t start, off_t *processed) {
+    // Open the specified file for reading only
+    FILE *movieFile = fopen(filePath, "r");
+    if (movieFile == NULL) {
+        perror(filePath);
+        return 0;
+    }
+
+    char *currLine = NULL;
+    size_t len = 0;
+    ssize_t nread;
+    int count = -1;
+    off_t offset = 0;
+    struct movie aMovie;
+
+    // Read the file line by line
+    struct statTimer timer = statsBegin();
+    while ((nread = getline(&currLine, &len, movieFile)) != -1) {
+        statsEnd(PHASE_READ, timer, nread);
+        if (processed != NULL && currLine[nread - 1] != '\n') {
+            break;
+        }
+        offset += nread;
+        if (count == -1) {
+            count++;
+            // Skip the rows an earlier run already partitioned
+            if (start > offset && fseeko(movieFile, start, SEEK_SET) == 0) {
+                offset = start;
+            }
+        }
+        else {
+            // Parse the current line and hand it to the partitions it belongs to
+            timer = statsBegin();
+            int parsed = createMovie(currLine, &aMovie);
+            statsEnd(PHASE_TOKENIZE, timer, nread);
+            if (parsed == 0) {
+                timer = statsBegin();
+                routeMovie(pool, &aMovie);
+                statsEnd(PHASE_INDEX, timer, 0);
+                count++;
+            }
+        }
+        timer = statsBegin();
+    }
+    free(currLine);
+    fclose(movieFile);
+    if (processed != NULL) {
+        *processed = offset;
+    }
+    printf("Now processing the chosen file named %s\n", filePath);
+    return count;
+}
+
+/*
+* Free a partition set whose partitions hold no buffers of their own
+*/
+void freePartitions(struct partitionSet *set) {
+    for (size_t i = 0; i < set->tableSize; i++) {
+        struct partition *part = set->table[i];
+        if (part != NULL) {
+            free(part->fileName);
+            free(part->key);
+            free(part);
+        }
+    }
+    free(set->table);
+}
+
+/*
+* Parse the rows of one chunk of a mapped input file, counting or copying
+* them as the chunk's pool says. Lines are copied out first because
+* createMovie splits them in place and the input is mapped read only.
+*/
+void *mapChunkMain(void *arg) {
+    struct mapChunk *chunk = arg;
+    char *line = NULL;
+    size_t cap = 0;
+    struct movie aMovie;
+    struct statTimer timer = statsBegin();
+    const char *row = chunk->start;
+    while (row < chunk->end) {
+        const char *newline = memchr(row, '\n', chunk->end - row);
+        size_t len = (newline == NULL) ? (size_t)(chunk->end - row) : (size_t)(newline - row + 1);
+        if (len + 1 > cap) {
+            cap = (len + 1) * 2;
+            line = statRealloc(line, cap);
+        }
+        memcpy(line, row, len);
+        line[len] = '\0';
+        row += len;
+        if (createMovie(line, &aMovie) == 0) {
+            routeMovie(&chunk->pool, &aMovie);
+        }
+    }
+    statsEnd((chunk->pool.mapPass == MAP_COUNT) ? PHASE_TOKENIZE : PHASE_OUTPUT, timer, chunk->end - chunk->start);
+    free(line);
+    mergeStats();
+    return NULL;
+}
+
+/*
+* Run one pass over every chunk, one thread per chunk
+*/
+void runChunks(struct mapChunk *chunks, int numChunks, int pass) {
+    for (int i = 0; i < numChunks; i++) {
+        chunks[i].pool.mapPass = pass;
+        pthread_create(&chunks[i].tid, NULL, mapChunkMain, &chunks[i]);
+    }
+    for (int i = 0; i < numChunks; i++) {
+        pthread_join(chunks[i].tid, NULL);
+    }
+}
+
+/*
+* Create a partition file at its final size and map it for writing.
+* Returns 0 on success and -1 on error.
+*/
+int mapPartition(struct partition *part) {
+    makePartitionDirs(part);
+    int fd = statOpen(part->fileName, O_RDWR | O_CREAT | O_TRUNC, 0640);
+    if (fd == -1) {
+        return -1;
+    }
+    // fallocate reserves the blocks up front; not every filesystem has it
+    if (fallocate(fd, 0, 0, part->len) == -1 && ftruncate(fd, part->len) == -1) {
+        statClose(fd);
+        return -1;
+    }
+    part->data = mmap(NULL, part->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    statClose(fd);
+    if (part->data == MAP_FAILED) {
+        part->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* Partition a file without any write calls. The input is mapped and split
+* into line aligned chunks, one per thread. A first pass counts the bytes
+* every chunk has for every partition; from those, each partition file is
+* created at its final size and mapped, and every chunk gets its own range
+* of it. A second pass parses the chunks again and copies the rows straight
+* into the mapped files.
+* Returns 0 on success and -1 on error.
+*/
+int mapFile(char *filePath, char *dirName) {
+    struct stat inputStat;
+    int fd = open(filePath, O_RDONLY);
+    if (fd == -1 || fstat(fd, &inputStat) == -1) {
+        perror(filePath);
+        return -1;
+    }
+    if (inputStat.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    char *input = mmap(NULL, inputStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (input == MAP_FAILED) {
+        perror(filePath);
+        return -1;
+    }
+    madvise(input, inputStat.st_size, MADV_SEQUENTIAL);
+    printf("Now processing the chosen file named %s\n", filePath);
+
+    // Split the rows after the header at the first newline after each cut
+    const char *end = input + inputStat.st_size;
+    const char *rows = memchr(input, '\n', inputStat.st_size);
+    rows = (rows == NULL) ? end : rows + 1;
+    int numChunks = writerCount();
+    if (numChunks == 0) {
+        numChunks = 1;
+    }
+    struct mapChunk *chunks = statCalloc(numChunks, sizeof(struct mapChunk));
+    const char *start = rows;
+    for (int i = 0; i < numChunks; i++) {
+        const char *cut = end;
+        if (i < numChunks - 1) {
+            cut = rows + (end - rows) * (i + 1) / numChunks;
+            cut = (cut < start) ? start : cut;
+            const char *newline = memchr(cut, '\n', end - cut);
+            cut = (newline == NULL) ? end : newline + 1;
+        }
+        chunks[i].start = start;
+        chunks[i].end = cut;
+        initPartitions(&chunks[i].pool.set, dirName, 1);
+        start = cut;
+    }
+    runChunks(chunks, numChunks, MAP_COUNT);
+
+    // Every chunk's rows go after the rows of the chunks before it
+    struct partitionSet files;
+    initPartitions(&files, dirName, 1);
+    for (int i = 0; i < numChunks; i++) {
+        struct partitionSet *set = &chunks[i].pool.set;
+        for (size_t j = 0; j < set->tableSize; j++) {
+            if (set->table[j] != NULL) {
+                struct partition *file = getPartition(&files, set->table[j]->key);
+                set->table[j]->cap = file->len;
+                file->len += set->table[j]->len;
+            }
+        }
+    }
+    int result = 0;
+    struct statTimer timer = statsBegin();
+    for (size_t j = 0; j < files.tableSize && result == 0; j++) {
+        if (files.table[j] != NULL) {
+            result = mapPartition(files.table[j]);
+        }
+    }
+    statsEnd(PHASE_OUTPUT, timer, 0);
+
+    if (result == 0) {
+        for (int i = 0; i < numChunks; i++) {
+            struct partitionSet *set = &chunks[i].pool.set;
+            for (size_t j = 0; j < set->tableSize; j++) {
+                if (set->table[j] != NULL) {
+                    struct partition *file = getPartition(&files, set->table[j]->key);
+                    set->table[j]->data = file->data + set->table[j]->cap;
+                    set->table[j]->len = 0;
+                }
+            }
+        }
+        runChunks(chunks, numChunks, MAP_COPY);
+
+        // The mapped files are complete, so their checksums come from memory
+        for (size_t j = 0; j < files.tableSize; j++) {
+            struct partition *file = files.table[j];
+            if (file != NULL) {
+                xxhUpdate(&file->hash, file->data, file->len);
+                if (statsEnabled) {
+                    stats.written += file->len;
+                }
+                addChecksum(file->key, countRows(file->data, file->len), file->len, xxhDigest(&file->hash));
+            }
+        }
+    }
+    else {
+        printf("Could not map the partition files of \"%s\"\n", dirName);
+        perror("Error");
+    }
+
+    for (size_t j = 0; j < files.tableSize; j++) {
+        if (files.table[j] != NULL && files.table[j]->data != NULL) {
+            munmap(files.table[j]->data, files.table[j]->len);
+        }
+    }
+    freePartitions(&files);
+    for (int i = 0; i < numChunks; i++) {
+        freePartitions(&chunks[i].pool.set);
+    }
+    free(chunks);
+    munmap(input, inputStat.st_size);
+    return result;
+}
+
+/*
+* nftw callback collecting every partition file below the output directory.
+* The key is the path relative to the directory without ".txt".
+*/
+int collectPackFile(const char *path, const struct stat *fileStat, int type, struct FTW *ftw) {
+    size_t length = strlen(path);
+    if (type != FTW_F || length < packFiles.rootLen + 5 || strcmp(path + length - 4, ".txt") != 0) {
+        return 0;
+    }
+    if (packFiles.count == packFiles.cap) {
+        packFiles.cap = (packFiles.cap == 0) ? 256 : packFiles.cap * 2;
+        packFiles.files = realloc(packFiles.files, packFiles.cap * sizeof(struct packFile));
+    }
+    packFiles.files[packFiles.count].key = strndup(path + packFiles.rootLen + 1, length - packFiles.rootLen - 5);
+    packFiles.files[packFiles.count].size = fileStat->st_size;
+    packFiles.count++;
+    return 0;
+}
+
+/*
+* nftw callback removing every file and directory of a tree, children first
+*/
+int removeTreeEntry(const char *path, const struct stat *fileStat, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+/*
+* Free the keys and files of a pack list
+*/
+void freePackList(struct packList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->files[i].key);
+    }
+    free(list->files);
+    memset(list, 0, sizeof(struct packList));
+}
+
+/*
+* nftw callback collecting the sorted run files batch shards wrote
+*/
+int collectRunFile(const char *path, const struct stat *fileStat, int type, struct FTW *ftw) {
+    if (type != FTW_F || strstr(path, ".txt.run") == NULL) {
+        return 0;
+    }
+    if (packFiles.count == packFiles.cap) {
+        packFiles.cap = (packFiles.cap == 0) ? 256 : packFiles.cap * 2;
+        packFiles.files = realloc(packFiles.files, packFiles.cap * sizeof(struct packFile));
+    }
+    packFiles.files[packFiles.count].key = strdup(path);
+    packFiles.files[packFiles.count].size = fileStat->st_size;
+    packFiles.count++;
+    return 0;
+}
+
+/*
+* Merge the sorted runs of one partition into its file, taking the
+* smallest head row each time and dropping the rating keys. The runs are
+* removed once the file is complete; if any run cannot be opened or read
+* they are all kept and the partial file is removed instead.
+* Returns 0 on success and -1 on error.
+*/
+int mergeRunFiles(struct packFile *runs, int numRuns) {
+    // Spilled runs mean a partition can have more runs than there are shards
+    FILE **in = statCalloc(numRuns, sizeof(FILE *));
+    char **heads = statCalloc(numRuns, sizeof(char *));
+    size_t *caps = statCalloc(numRuns, sizeof(size_t));
+    char target[MAX_KEY_LEN + 300];
+    snprintf(target, sizeof(target), "%s", runs[0].key);
+    *strstr(target, ".txt.run") = '\0';
+    strcat(target, ".txt");
+
+    int result = 0;
+    for (int i = 0; i < numRuns; i++) {
+        in[i] = fopen(runs[i].key, "r");
+        heads[i] = NULL;
+        caps[i] = 0;
+        if (in[i] == NULL) {
+            result = -1;
+        }
+        else if (getline(&heads[i], &caps[i], in[i]) == -1) {
+            free(heads[i]);
+            heads[i] = NULL;
+        }
+    }
+    FILE *out = NULL;
+    if (result == 0) {
+        int fd = statOpen(target, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+        out = (fd == -1) ? NULL : fdopen(fd, "w");
+        if (out == NULL) {
+            if (fd != -1) {
+                statClose(fd);
+                unlink(target);
+            }
+            result = -1;
+        }
+    }
+    while (result == 0) {
+        int best = -1;
+        for (int i = 0; i < numRuns; i++) {
+            if (heads[i] != NULL && (best == -1 || strcmp(heads[i], heads[best]) < 0)) {
+                best = i;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        fputs(heads[best] + RATING_KEY_LEN, out);
+        if (getline(&heads[best], &caps[best], in[best]) == -1) {
+            free(heads[best]);
+            heads[best] = NULL;
+        }
+    }
+
+    // getline also returns -1 on a read error, which only ferror tells apart from the end
+    for (int i = 0; i < numRuns; i++) {
+        if (in[i] != NULL) {
+            if (ferror(in[i])) {
+                result = -1;
+            }
+            fclose(in[i]);
+        }
+        free(heads[i]);
+    }
+    if (out != NULL) {
+        if (ferror(out)) {
+            result = -1;
+        }
+        if (fclose(out) != 0) {
+            result = -1;
+        }
+        if (result == -1) {
+            unlink(target);
+        }
+    }
+    for (int i = 0; i < numRuns && result == 0; i++) {
+        unlink(runs[i].key);
+    }
+    free(in);
+    free(heads);
+    free(caps);
+    return result;
+}
+
+/*
+* Combine the sorted runs every batch shard wrote for each partition
+* with a k-way merge
+*/
+void mergeSortedRuns(char *dirName) {
+    struct statTimer timer = statsBegin();
+    memset(&packFiles, 0, sizeof(packFiles));
+    nftw(dirName, collectRunFile, 16, FTW_PHYS);
+    qsort(packFiles.files, packFiles.count, sizeof(struct packFile), comparePackFiles);
+    size_t first = 0;
+    while (first < packFiles.count) {
+        // Runs of one partition share everything before ".run"
+        size_t baseLen = strstr(packFiles.files[first].key, ".txt.run") - packFiles.files[first].key;
+        size_t last = first + 1;
+        while (last < packFiles.count && strncmp(packFiles.files[last].key, packFiles.files[first].key, baseLen + 8) == 0) {
+            last++;
+        }
+        if (mergeRunFiles(&packFiles.files[first], last - first) == -1) {
+            printf("Could not merge the runs of \"%.*s\"\n", (int)baseLen, packFiles.files[first].key);
+            perror("Error");
+        }
+        first = last;
+    }
+    freePackList(&packFiles);
+    statsEnd(PHASE_OUTPUT, timer, 0);
+}
+
+/*
+* Parser thread of a batch run. Every file it takes is parsed into the
+* thread's own partition buffers, so rows are never locked or handed to
+* another thread; the buffers are whole lines and are written with
+* O_APPEND, so shards writing the same partition file do not overwrite
+* each other.
+*/
+void *parserMain(void *arg) {
+    struct batchJob *job = arg;
+    struct writerPool shard;
+    char *filePath;
+    memset(&shard, 0, sizeof(struct writerPool));
+    initPartitions(&shard.set, job->dirName, job->maxOpen);
+    if (opts.sorted) {
+        int index = __atomic_fetch_add(&job->shards, 1, __ATOMIC_RELAXED);
+        snprintf(shard.set.runSuffix, sizeof(shard.set.runSuffix), ".run%d", index);
+    }
+    while ((filePath = popQueue(&job->queue)) != NULL) {
+        int count = processFile(filePath, &shard, 0, NULL);
+        __atomic_add_fetch(&job->count, count, __ATOMIC_RELAXED);
+    }
+    closePartitions(&shard.set);
+    mergeStats();
+    return NULL;
+}
+
+/*
+* Parse several files at once on up to --threads parser threads, all
+* writing into the partition tree at dirName.
+* Returns the number of movies processed.
+*/
+int processBatch(char **filePaths, int numFiles, char *dirName) {
+    pthread_t tids[MAX_WORKERS];
+    struct batchJob job;
+    int numParsers = writerCount();
+    if (numParsers == 0) {
+        numParsers = 1;
+    }
+    if (numParsers > numFiles) {
+        numParsers = numFiles;
+    }
+    initQueue(&job.queue);
+    job.dirName = dirName;
+    job.maxOpen = openLimit() / numParsers;
+    job.count = 0;
+    job.shards = 0;
+    for (int i = 0; i < numParsers; i++) {
+        pthread_create(&tids[i], NULL, parserMain, &job);
+    }
+    for (int i = 0; i < numFiles; i++) {
+        pushQueue(&job.queue, filePaths[i]);
+    }
+    for (int i = 0; i < numParsers; i++) {
+        pushQueue(&job.queue, NULL);
+    }
+    for (int i = 0; i < numParsers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if (opts.sorted) {
+        mergeSortedRuns(dirName);
+    }
+    return job.count;
+}
+
+/* Directory entry as returned by getdents64 */
+struct linuxDirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* One candidate csv file and its size, a NULL name marks an empty slot */
+struct csvEntry {
+    char *name;
+    off_t size;
+    int deleted;
+};
+
+/*
+*  Index of the movies_*.csv files in the current directory, built with one
+*  getdents64 scan and then kept up to date from inotify events, so picking
+*  the largest or smallest file does not rescan the directory. The entries
+*  are an open addressing hash table keyed by name.
+*/
+struct csvIndex {
+    int built;
+    int dirFd;
+    int inotifyFd;
+    struct csvEntry *table;
+    size_t tableSize;
+    size_t used;
+};
+
+struct csvIndex csvFiles = {0, -1, -1, NULL, 0, 0};
+
+/*
+* Return nonzero if a name is a movies_ prefixed csv file name
+*/
+int isCandidate(const char *name) {
+    size_t length = strlen(name);
+    return strncmp(PREFIX, name, strlen(PREFIX)) == 0 && length >= 4 &&
+            strcmp(name + length - 4, ".csv") == 0;
+}
+
+/*
+* Find the slot holding a name, or the empty slot where it would go
+*/
+struct csvEntry *findCsv(const char *name) {
+    size_t mask = csvFiles.tableSize - 1;
+    size_t slot = hashKey(name) & mask;
+    struct csvEntry *tombstone = NULL;
+    while (csvFiles.table[slot].name != NULL) {
+        struct csvEntry *entry = &csvFiles.table[slot];
+        if (entry->deleted) {
+            if (tombstone == NULL) {
+                tombstone = entry;
+            }
+        }
+        else if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return (tombstone != NULL) ? tombstone : &csvFiles.table[slot];
+}
+
+/*
+* Insert or update the size of a csv file, growing the table when it is half full
+*/
+void putCsv(const char *name, off_t size) {
+    if ((csvFiles.used + 1) * 2 > csvFiles.tableSize) {
+        struct csvEntry *old = csvFiles.table;
+        size_t oldSize = csvFiles.tableSize;
+        csvFiles.tableSize = (oldSize == 0) ? 1024 : oldSize * 2;
+        csvFiles.table = calloc(csvFiles.tableSize, sizeof(struct csvEntry));
+        csvFiles.used = 0;
+        for (size_t i = 0; i < oldSize; i++) {
+            if (old[i].name != NULL && !old[i].deleted) {
+                *findCsv(old[i].name) = old[i];
+                csvFiles.used++;
+            }
+            else {
+                free(old[i].name);
+            }
+        }
+        free(old);
+    }
+    struct csvEntry *entry = findCsv(name);
+    if (entry->name == NULL || entry->deleted) {
+        if (entry->name == NULL) {
+            csvFiles.used++;
+        }
+        free(entry->name);
+        entry->name = strdup(name);
+        entry->deleted = 0;
+    }
+    entry->size = size;
+}
+
+/*
+* Remove a csv file from the index, leaving a tombstone
+*/
+void dropCsv(const char *name) {
+    if (csvFiles.tableSize == 0) {
+        return;
+    }
+    struct csvEntry *entry = findCsv(name);
+    if (entry->name != NULL && !entry->deleted) {
+        entry->deleted = 1;
+    }
+}
+
+/*
+* Look a candidate name up with fstatat relative to the directory and
+* add, update or remove it in the index
+*/
+void refreshCsv(const char *name) {
+    struct stat dirStat;
+    if (statFstatat(csvFiles.dirFd, name, &dirStat, 0) == 0 && S_ISREG(dirStat.st_mode)) {
+        putCsv(name, dirStat.st_size);
+    }
+    else {
+        dropCsv(name);
+    }
+}
+
+/*
+* Scan the directory with getdents64 into a large buffer. Names are checked
+* before anything else and entries whose d_type shows they are not regular
+* files or symlinks are skipped without a stat.
+*/
+void scanCsvFiles() {
+    for (size_t i = 0; i < csvFiles.tableSize; i++) {
+        free(csvFiles.table[i].name);
+    }
+    free(csvFiles.table);
+    csvFiles.table = NULL;
+    csvFiles.tableSize = 0;
+    csvFiles.used = 0;
+
+    char *buffer = malloc(DENTS_BUFFER);
+    lseek(csvFiles.dirFd, 0, SEEK_SET);
+    long nread;
+    while ((nread = statGetdents(csvFiles.dirFd, buffer, DENTS_BUFFER)) > 0) {
+        for (long pos = 0; pos < nread;) {
+            struct linuxDirent64 *entry = (struct linuxDirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+            if (!isCandidate(entry->d_name)) {
+                continue;
+            }
+            if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG && entry->d_type != DT_LNK) {
+                continue;
+            }
+            refreshCsv(entry->d_name);
+        }
+    }
+    free(buffer);
+}
+
+/*
+* Open the current directory, watch it with inotify and build the index
+*/
+void buildCsvIndex() {
+    csvFiles.dirFd = statOpen(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    csvFiles.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (csvFiles.inotifyFd != -1 &&
+            inotify_add_watch(csvFiles.inotifyFd, ".", IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                IN_MOVED_TO | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB) == -1) {
+        close(csvFiles.inotifyFd);
+        csvFiles.inotifyFd = -1;
+    }
+    scanCsvFiles();
+    csvFiles.built = 1;
+}
+
+/*
+* Apply the inotify events that arrived since the last call. Without
+* inotify, or if the event queue overflowed, the directory is rescanned.
+*/
+void updateCsvIndex() {
+    if (csvFiles.inotifyFd == -1) {
+        scanCsvFiles();
+        return;
+    }
+    char buffer[INOTIFY_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t nread;
+    int rescan = 0;
+    while ((nread = read(csvFiles.inotifyFd, buffer, sizeof(buffer))) > 0) {
+        for (char *pos = buffer; pos < buffer + nread;) {
+            struct inotify_event *event = (struct inotify_event *)pos;
+            pos += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan = 1;
+            }
+            else if (event->len > 0 && isCandidate(event->name)) {
+                refreshCsv(event->name);
+            }
+        }
+    }
+    if (rescan) {
+        scanCsvFiles();
+    }
+}
+
+/*
+* Read in the files from the directory.
+* Return the file name of movies file that is found depending on user input.
+* For options 1 and 2 this function will check for csv. files with suffix "movies_"
+* using the cached index; empty files are never picked. For option 3 the
+* name is returned if it exists in the directory and "" otherwise.
+*/
+char *readDir(int option, char path[]) {
+    struct statTimer timer = statsBegin();
+    char *entryName = "z";
+
+    if (option == 3) {
+        struct stat dirStat;
+        int dirFd = (csvFiles.dirFd != -1) ? csvFiles.dirFd : AT_FDCWD;
+        entryName = "";
+        if (strchr(path, '/') == NULL && statFstatat(dirFd, path, &dirStat, AT_SYMLINK_NOFOLLOW) == 0) {
+            entryName = path;
+        }
+        statsEnd(PHASE_QUERY, timer, 0);
+        return strdup(entryName);
+    }
+
+    if (!csvFiles.built) {
+        buildCsvIndex();
+    }
+    else {
+        updateCsvIndex();
+    }
+
+    // Depending on the option, look for the largest or smallest file,
+    // ties go to the first name in alphabetical order
+    off_t best = 0;
+    for (size_t i = 0; i < csvFiles.tableSize; i++) {
+        struct csvEntry *entry = &csvFiles.table[i];
+        if (entry->name == NULL || entry->deleted || entry->size == 0) {
+            continue;
+        }
+        int better = (best == 0) ||
+                (option == 1 && entry->size > best) ||
+                (option == 2 && entry->size < best) ||
+                (entry->size == best && strcmp(entry->name, entryName) < 0);
+        if (better) {
+            entryName = entry->name;
+            best = entry->size;
+        }
+    }
+    statsEnd(PHASE_QUERY, timer, 0);
+    return strdup(entryName);
+}
+
+/*
+* Print the top level user instruction and read in choices
+*/
+int instructions() {
+    int i = 0;
+    while (i < 1 || i > 2) {
+        printf("\n1. Select file to process\n"
+                "2. Exit from the program\n"
+                "\nEnter a choice 1 or 2:  ");
+        scanf("%i", &i);
+
+        // only continue with integer inputs between 1 and 2
+        if (i < 1 || i > 2) {
+            printf("You entered an incorrect choice. Try again.\n");
+        }
+    }
+    return i;
+}
+
+/*
+* Ask the user what file they want to process and read in choices
+*/
+int chooseFile() {
+    int i = 0;
+    while (i < 1 || i > 3) {
+        printf("\nWhat file you want to process?\n"
+                "1. Enter 1 to pick the largest file\n"
+                "2. Enter 2 to pick the smallest file\n"
+                "3. Enter 3 to specify the name of a file\n"
+                "\nEnter a choice from 1 to 3:  ");
+        scanf("%i", &i);
+
+        // only continue with integer inputs between 1 and 3
+        if (i < 1 || i > 3) {
+            printf("You entered an incorrect choice. Try again.\n");
+        }
+    }
+    return i;
+}
+
+/*
+* Copy len bytes from the current offset of in to the current offset of out,
+* in the kernel with copy_file_range when it is supported
+*/
+int copyData(int in, int out, off_t len) {
+    char *buffer = NULL;
+    while (len > 0) {
+        ssize_t copied = -1;
+        if (buffer == NULL) {
+            copied = copy_file_range(in, NULL, out, NULL, len, 0);
+            if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                buffer = malloc(COPY_CHUNK);
+                continue;
+            }
+        }
+        else {
+            copied = read(in, buffer, (len < COPY_CHUNK) ? len : COPY_CHUNK);
+            if (copied > 0 && writeAll(out, buffer, copied) == -1) {
+                copied = -1;
+            }
+        }
+        if (copied <= 0) {
+            free(buffer);
+            return -1;
+        }
+        len -= copied;
+    }
+    free(buffer);
+    return 0;
+}
+
+/*
+* Pack every partition file of dirName into one archive file archiveName
+* with an index of (key, offset, length) up front, then remove the directory.
+* The partitions were flushed to these staging files under the usual bound
+* on resident buffers, so packing never holds more than one copy chunk.
+* Returns 0 on success and -1 on error.
+*/
+int packArchive(char *dirName, char *archiveName) {
+    memset(&packFiles, 0, sizeof(packFiles));
+    packFiles.rootLen = strlen(dirName);
+    nftw(dirName, collectPackFile, 16, FTW_PHYS);
+
+    // Sort the keys so readers can binary search the index
+    struct packFile *files = packFiles.files;
+    qsort(files, packFiles.count, sizeof(struct packFile), comparePackFiles);
+
+    struct archiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, 8);
+    header.count = packFiles.count;
+    header.keysOffset = sizeof(header) + packFiles.count * sizeof(struct archiveEntry);
+    struct archiveEntry *entries = calloc(packFiles.count + 1, sizeof(struct archiveEntry));
+    uint64_t keyBytes = 0;
+    for (size_t i = 0; i < packFiles.count; i++) {
+        entries[i].keyOffset = keyBytes;
+        entries[i].keyLength = strlen(files[i].key);
+        keyBytes += entries[i].keyLength;
+    }
+    header.dataOffset = header.keysOffset + keyBytes;
+    uint64_t offset = header.dataOffset;
+    for (size_t i = 0; i < packFiles.count; i++) {
+        entries[i].offset = offset;
+        entries[i].length = files[i].size;
+        offset += entries[i].length;
+    }
+
+    int result = -1;
+    int out = statOpen(archiveName, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (out != -1 && writeAll(out, (char *)&header, sizeof(header)) == 0 &&
+            writeAll(out, (char *)entries, packFiles.count * sizeof(struct archiveEntry)) == 0) {
+        result = 0;
+        for (size_t i = 0; i < packFiles.count && result == 0; i++) {
+            result = writeAll(out, files[i].key, entries[i].keyLength);
+        }
+        char path[MAX_KEY_LEN + 300];
+        for (size_t i = 0; i < packFiles.count && result == 0; i++) {
+            snprintf(path, sizeof(path), "%s/%s.txt", dirName, files[i].key);
+            int in = statOpen(path, O_RDONLY, 0);
+            result = (in == -1) ? -1 : copyData(in, out, entries[i].length);
+            if (in != -1) {
+                statClose(in);
+            }
+        }
+    }
+    if (out == -1 || result == -1) {
+        printf("Could not write archive \"%s\"\n", archiveName);
+        perror("Error");
+    }
+    if (out != -1) {
+        statClose(out);
+    }
+
+    if (result == 0) {
+        nftw(dirName, removeTreeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    freePackList(&packFiles);
+    free(entries);
+    return result;
+}
+
+/*
+* Check that the index, the keys and the rows of every entry of a mapped
+* archive of size bytes lie inside it. Returns 0 if they do and -1 if not.
+*/
+int checkArchive(const char *map, uint64_t size) {
+    const struct archiveHeader *header = (const struct archiveHeader *)map;
+    if (header->count > (size - sizeof(struct archiveHeader)) / sizeof(struct archiveEntry) ||
+            header->keysOffset < sizeof(struct archiveHeader) + header->count * sizeof(struct archiveEntry) ||
+            header->keysOffset > header->dataOffset || header->dataOffset > size) {
+        return -1;
+    }
+    const struct archiveEntry *entries = (const struct archiveEntry *)(map + sizeof(struct archiveHeader));
+    uint64_t keyBytes = header->dataOffset - header->keysOffset;
+    for (uint64_t i = 0; i < header->count; i++) {
+        if (entries[i].keyOffset > keyBytes || entries[i].keyLength > keyBytes - entries[i].keyOffset ||
+                entries[i].offset > size || entries[i].length > size - entries[i].offset) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+* Print one partition of a packed archive, or list its partitions when key
+* is NULL. The archive is mmapped and the key found by binary search on the
+* index, so only the pages of that partition are read.
+*/
+int extractArchive(char *archiveName, char *key) {
+    int fd = open(archiveName, O_RDONLY);
+    struct stat archiveStat;
+    if (fd == -1 || fstat(fd, &archiveStat) == -1) {
+        perror(archiveName);
+        return EXIT_FAILURE;
+    }
+    char *map = NULL;
+    if (archiveStat.st_size >= (off_t)sizeof(struct archiveHeader)) {
+        map = mmap(NULL, archiveStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    struct archiveHeader *header = (struct archiveHeader *)map;
+    if (map == NULL || map == MAP_FAILED || memcmp(header->magic, ARCHIVE_MAGIC, 8) != 0) {
+        printf("%s is not a movies archive\n", archiveName);
+        return EXIT_FAILURE;
+    }
+    if (checkArchive(map, archiveStat.st_size) == -1) {
+        printf("%s is corrupt\n", archiveName);
+        munmap(map, archiveStat.st_size);
+        return EXIT_FAILURE;
+    }
+    struct archiveEntry *entries = (struct archiveEntry *)(map + sizeof(struct archiveHeader));
+    char *keys = map + header->keysOffset;
+
+    if (key == NULL) {
+        for (uint64_t i = 0; i < header->count; i++) {
+            printf("%.*s %llu\n", (int)entries[i].keyLength, keys + entries[i].keyOffset,
+                    (unsigned long long)entries[i].length);
+        }
+        munmap(map, archiveStat.st_size);
+        return EXIT_SUCCESS;
+    }
 
-/* struct for movie information */
-struct movie {
-    char *title;
-    int year;
-    struct movie *next;
-};
+    size_t low = 0;
+    size_t high = header->count;
+    size_t keyLength = strlen(key);
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        struct archiveEntry *entry = &entries[mid];
+        size_t common = (entry->keyLength < keyLength) ? entry->keyLength : keyLength;
+        int cmp = memcmp(keys + entry->keyOffset, key, common);
+        if (cmp == 0) {
+            cmp = (entry->keyLength > keyLength) - (entry->keyLength < keyLength);
+        }
+        if (cmp == 0) {
+            fwrite(map + entry->offset, 1, entry->length, stdout);
+            munmap(map, archiveStat.st_size);
+            return EXIT_SUCCESS;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    printf("No partition %s in %s\n", key, archiveName);
+    munmap(map, archiveStat.st_size);
+    return EXIT_FAILURE;
+}
 
-/* 
-*  Parse the current line which is space delimited and create a
-*  movie struct with the data in this line
+/*
+* nftw callback flushing a staged tree for --sync=fdatasync: the data of
+* every file and then each directory, children before parents
 */
-struct movie *createMovie(char *currLine) {
-    struct movie *currMovie = malloc(sizeof(struct movie));
+int syncTreeEntry(const char *path, const struct stat *fileStat, int type, struct FTW *ftw) {
+    int fd = statOpen(path, O_RDONLY, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    countCall(CALL_SYNC);
+    int result = (type == FTW_F) ? fdatasync(fd) : fsync(fd);
+    statClose(fd);
+    return result;
+}
 
-    // For use with strtok_r
-    char *saveptr;
+/*
+* Make a staged directory or file durable as chosen by --sync. syncfs
+* flushes the whole filesystem in one call, fdatasync walks the tree once
+* after every writer is done instead of syncing as each file is closed.
+* Returns 0 on success and -1 on error.
+*/
+int syncOutput(char *stageName) {
+    if (opts.sync == SYNC_NONE) {
+        return 0;
+    }
+    if (opts.sync == SYNC_FDATASYNC) {
+        return nftw(stageName, syncTreeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    int fd = statOpen(stageName, O_RDONLY, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    countCall(CALL_SYNC);
+    int result = syncfs(fd);
+    statClose(fd);
+    return result;
+}
 
-    // The first token is the title
-    char *token = strtok_r(currLine, ",", &saveptr);
-    currMovie->title = calloc(strlen(token) + 1, sizeof(char));
-    strcpy(currMovie->title, token);
+/*
+* Sync the directory holding path so a rename in it survives a crash
+*/
+void syncParent(const char *path) {
+    if (opts.sync == SYNC_NONE) {
+        return;
+    }
+    char *copy = strdup(path);
+    int fd = statOpen(dirname(copy), O_RDONLY | O_DIRECTORY, 0);
+    if (fd != -1) {
+        countCall(CALL_SYNC);
+        fsync(fd);
+        statClose(fd);
+    }
+    free(copy);
+}
 
-    // The next token is the year
-    token = strtok_r(NULL, ",", &saveptr);
-    currMovie->year = atoi(token);
+/*
+* Sync the staged output, rename it atomically to its final name and sync
+* the directory above it so the rename itself survives a crash. A final
+* directory that already exists is swapped with the staged one in a single
+* rename and then removed.
+* Returns 0 on success and -1 on error.
+*/
+int publishOutput(char *stageName, char *finalName) {
+    int result = syncOutput(stageName);
+    countCall(CALL_RENAME);
+    if (result == 0 && rename(stageName, finalName) == -1) {
+        result = -1;
+        if ((errno == ENOTEMPTY || errno == EEXIST) &&
+                renameat2(AT_FDCWD, stageName, AT_FDCWD, finalName, RENAME_EXCHANGE) == 0) {
+            nftw(stageName, removeTreeEntry, 16, FTW_DEPTH | FTW_PHYS);
+            result = 0;
+        }
+    }
+    if (result == -1) {
+        printf("Could not publish \"%s\"\n", finalName);
+        perror("Error");
+        return -1;
+    }
+    syncParent(finalName);
+    return 0;
+}
 
-    // Set the next node to NULL in the newly created movie entry
-    currMovie->next = NULL;
+/*
+* Remove staging directories and archives a crashed run left behind in the
+* current directory. They were never renamed, so nothing refers to them.
+*/
+void removeStaleStaging() {
+    DIR *currDir = opendir(".");
+    if (currDir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(currDir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (strncmp(entry->d_name, ".younga6.movies.", 16) == 0 && length > 20 &&
+                strcmp(entry->d_name + length - 4, ".tmp") == 0) {
+            nftw(entry->d_name, removeTreeEntry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    }
+    closedir(currDir);
+}
 
-    return currMovie;
+/*
+* Continue a 64 bit FNV-1a hash over len bytes of data
+*/
+unsigned long long hashBytes(unsigned long long h, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
 }
 
 /*
-* Return a linked list of movies by parsing data from
-* each line of the specified file.
+* Fingerprint an input file by hashing its header line and the bytes just
+* before offset, so a file that was rewritten instead of appended to is
+* noticed without reading all of it.
+* Returns 0 on success and -1 on error.
 */
-struct movie *processFile(char *filePath) {
-    // Open the specified file for reading only
-    FILE *movieFile = fopen(filePath, "r");
+int inputFingerprint(char *filePath, off_t offset, unsigned long long *fingerprint) {
+    char window[FINGERPRINT_WINDOW];
+    int fd = open(filePath, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t nread = pread(fd, window, sizeof(window), 0);
+    char *newline = (nread > 0) ? memchr(window, '\n', nread) : NULL;
+    unsigned long long h = 14695981039346656037ULL;
+    off_t header = 0;
+    if (newline != NULL) {
+        header = newline - window + 1;
+        h = hashBytes(h, window, header);
+    }
+    off_t from = (offset - FINGERPRINT_WINDOW > header) ? offset - FINGERPRINT_WINDOW : header;
+    nread = (offset > from) ? pread(fd, window, offset - from, from) : 0;
+    close(fd);
+    if (nread != offset - from && offset > from) {
+        return -1;
+    }
+    *fingerprint = hashBytes(h, window, nread);
+    return 0;
+}
 
-    char *currLine = NULL;
+/*
+* Write the partition key of opts as given to --key, e.g. "decade/year"
+*/
+void keySpec(char *buf, size_t size) {
+    buf[0] = '\0';
+    for (int i = 0; i < opts.numKeyLevels; i++) {
+        if (i > 0) {
+            strncat(buf, "/", size - strlen(buf) - 1);
+        }
+        strncat(buf, keyNames[opts.keyLevels[i]], size - strlen(buf) - 1);
+    }
+}
+
+/*
+* Read the manifest of an incremental output directory.
+* Returns 0 on success and -1 if it is missing or not valid.
+*/
+int readManifest(char *dirName, struct manifest *m) {
+    char path[300];
+    char *line = NULL;
     size_t len = 0;
     ssize_t nread;
-    char *token;
-    int count = -1;
+    long long size;
+    int fields = 0;
+    memset(m, 0, sizeof(struct manifest));
+    snprintf(path, sizeof(path), "%s/%s", dirName, MANIFEST_NAME);
+    FILE *manifestFile = fopen(path, "r");
+    if (manifestFile == NULL) {
+        return -1;
+    }
+    while ((nread = getline(&line, &len, manifestFile)) != -1) {
+        int keyStart = 0;
+        if (line[nread - 1] == '\n') {
+            line[--nread] = '\0';
+        }
+        if (strcmp(line, MANIFEST_MAGIC) == 0) {
+            fields++;
+        }
+        else if (strncmp(line, "input ", 6) == 0) {
+            strncpy(m->input, line + 6, sizeof(m->input) - 1);
+        }
+        else if (strncmp(line, "key ", 4) == 0) {
+            strncpy(m->key, line + 4, sizeof(m->key) - 1);
+        }
+        else if (sscanf(line, "size %lld", &size) == 1) {
+            m->size = size;
+        }
+        else if (sscanf(line, "processed %lld", &size) == 1) {
+            m->processed = size;
+        }
+        else if (sscanf(line, "fingerprint %llx", &m->fingerprint) == 1) {
+            fields++;
+        }
+        else if (sscanf(line, "partition %lld %n", &size, &keyStart) == 1 && keyStart > 0) {
+            if (m->parts.count == m->parts.cap) {
+                m->parts.cap = (m->parts.cap == 0) ? 256 : m->parts.cap * 2;
+                m->parts.files = realloc(m->parts.files, m->parts.cap * sizeof(struct packFile));
+            }
+            m->parts.files[m->parts.count].key = strdup(line + keyStart);
+            m->parts.files[m->parts.count].size = size;
+            m->parts.count++;
+        }
+    }
+    free(line);
+    fclose(manifestFile);
+    if (fields != 2) {
+        freePackList(&m->parts);
+        return -1;
+    }
+    qsort(m->parts.files, m->parts.count, sizeof(struct packFile), comparePackFiles);
+    return 0;
+}
 
-    // The head of the linked list
-    struct movie *head = NULL;
-    // The tail of the linked list
-    struct movie *tail = NULL;
+/*
+* Record the partition files of dirName and their sizes in its manifest.
+* The manifest is written to a temporary file and renamed over the old one,
+* so it always describes one complete run.
+* Returns 0 on success and -1 on error.
+*/
+int writeManifest(char *dirName, struct manifest *m) {
+    char path[300];
+    char tmpPath[310];
+    snprintf(path, sizeof(path), "%s/%s", dirName, MANIFEST_NAME);
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *manifestFile = fopen(tmpPath, "w");
+    if (manifestFile == NULL) {
+        return -1;
+    }
 
-    // Read the file line by line
-    while ((nread = getline(&currLine, &len, movieFile)) != -1) {
-        if (count == -1) {
-            count++;
-        }
-        else {
-            // Get a new movie node corresponding to the current line
-            struct movie *newNode = createMovie(currLine);
-            count++;
+    memset(&packFiles, 0, sizeof(packFiles));
+    packFiles.rootLen = strlen(dirName);
+    nftw(dirName, collectPackFile, 16, FTW_PHYS);
+    fprintf(manifestFile, "%s\ninput %s\nkey %s\nsize %lld\nprocessed %lld\nfingerprint %llx\n",
+            MANIFEST_MAGIC, m->input, m->key, (long long)m->size, (long long)m->processed, m->fingerprint);
+    for (size_t i = 0; i < packFiles.count; i++) {
+        fprintf(manifestFile, "partition %lld %s\n", (long long)packFiles.files[i].size, packFiles.files[i].key);
+    }
+    freePackList(&packFiles);
 
-            // Is this the first node in the linked list?
-            if (head == NULL) {
-                // This is the first node in the linked link
-                // Set the head and the tail to this node
-                head = newNode;
-                tail = newNode;
-            }
-            else {
-                // This is not the first node.
-                // Add this node to the list and advance the tail
-                tail->next = newNode;
-                tail = newNode;
-            }
+    int result = (fflush(manifestFile) == 0) ? 0 : -1;
+    if (result == 0 && opts.sync != SYNC_NONE) {
+        countCall(CALL_SYNC);
+        result = fdatasync(fileno(manifestFile));
+    }
+    countCall(CALL_RENAME);
+    if (fclose(manifestFile) != 0 || result == -1 || rename(tmpPath, path) == -1) {
+        return -1;
+    }
+    syncParent(path);
+    return 0;
+}
+
+/*
+* Bring the partition files of dirName back to the sizes in its manifest:
+* files that grew since are truncated and files it does not list are
+* removed, undoing a run that stopped before writing its manifest.
+* Returns 0 on success and -1 if a file is shorter than it should be.
+*/
+int recoverPartitions(char *dirName, struct manifest *m) {
+    char path[MAX_KEY_LEN + 300];
+    int result = 0;
+    memset(&packFiles, 0, sizeof(packFiles));
+    packFiles.rootLen = strlen(dirName);
+    nftw(dirName, collectPackFile, 16, FTW_PHYS);
+    for (size_t i = 0; i < packFiles.count && result == 0; i++) {
+        struct packFile *committed = bsearch(&packFiles.files[i], m->parts.files, m->parts.count,
+                sizeof(struct packFile), comparePackFiles);
+        snprintf(path, sizeof(path), "%s/%s.txt", dirName, packFiles.files[i].key);
+        if (committed == NULL) {
+            result = unlink(path);
+        }
+        else if (packFiles.files[i].size > committed->size) {
+            result = truncate(path, committed->size);
+        }
+        else if (packFiles.files[i].size < committed->size) {
+            result = -1;
         }
     }
-    free(currLine);
-    fclose(movieFile);
-    printf("Now processing the chosen file named %s\n", filePath);
-    return head;
+    freePackList(&packFiles);
+    return result;
 }
 
 /*
-* Read in the files from the directory.
-* Return the file name of movies file that is found depending on user input.
-* For options 1 and 2 this function will check for csv. files with suffix "movies_"
+* Partition filePath into the directory given to --incremental. If the
+* directory's manifest says it was built from the same file with the same
+* key, only the complete rows added to the file since are parsed and
+* appended to the existing partition files. Otherwise the directory is
+* built again from the start in staging and swapped in.
 */
-char *readDir(int option, char path[]) {
-    // Open the current directory
-    DIR* currDir = opendir(".");
-    struct dirent *aDir;
-    int fileSize = 0;
-    int temp = 0;
-    int length = 0;
-    struct stat dirStat;
-    char entryName[256] = "z";
-
-    // Go through all the entries
-    while ((aDir = readdir(currDir)) != NULL) {
-        // With prefix movies_
-        if (strncmp(PREFIX, aDir->d_name, strlen(PREFIX)) == 0) {
-            // Get meta-data for the current entry
-            stat(aDir->d_name, &dirStat);
-
-            char tempEntry[256];
-            strcpy(tempEntry, aDir->d_name);
-            length = strlen(tempEntry);
-            const char *check_csv = &tempEntry[length - 4];
-
-            // If file extention is a csv 
-            if (strcmp(check_csv, ".csv") == 0) {
-                fileSize = dirStat.st_size;
-                // Depending on the option, check for smaller or larger files
-                if (option == 1 && fileSize > temp) {
-                    memset(entryName, '\0', sizeof(entryName));
-                    strcpy(entryName, aDir->d_name);
-                    temp = fileSize;
-                }
-                else if (option == 2 && (fileSize < temp || temp == 0)) {
-                    memset(entryName, '\0', sizeof(entryName));
-                    strcpy(entryName, aDir->d_name);
-                    temp = fileSize;
-                }
-            }
-            
+void incrementalDir(char *filePath) {
+    char *dirName = opts.incremental;
+    struct manifest m;
+    struct stat inputStat;
+    struct writerPool pool;
+    unsigned long long fingerprint;
+    char key[MAX_KEY_LEN];
+    off_t processed = 0;
+
+    keySpec(key, sizeof(key));
+    if (stat(filePath, &inputStat) == -1) {
+        perror(filePath);
+        return;
+    }
+    // The manifest could not match a path it has to cut short, so it is refused
+    if (strlen(filePath) >= sizeof(m.input)) {
+        printf("The path %s is too long to record in the manifest\n", filePath);
+        return;
+    }
+    int fresh = readManifest(dirName, &m) == -1 || strcmp(m.input, filePath) != 0 ||
+            strcmp(m.key, key) != 0 || inputStat.st_size < m.processed ||
+            inputFingerprint(filePath, m.processed, &fingerprint) == -1 || fingerprint != m.fingerprint;
+    if (!fresh && recoverPartitions(dirName, &m) == -1) {
+        printf("Partition files of %s are damaged, rebuilding it\n", dirName);
+        fresh = 1;
+    }
+    freePackList(&m.parts);
+
+    char stageName[300];
+    snprintf(stageName, sizeof(stageName), "%s.tmp", dirName);
+    if (fresh) {
+        nftw(stageName, removeTreeEntry, 16, FTW_DEPTH | FTW_PHYS);
+        if (statMkdir(stageName, 0750) == -1) {
+            printf("mkdir() failed on \"%s\"\n", stageName);
+            perror("Error");
+            return;
         }
+        m.processed = 0;
+    }
+    char *outName = fresh ? stageName : dirName;
+
+    startWriters(&pool, outName);
+    int count = processFile(filePath, &pool, m.processed, &processed);
+    stopWriters(&pool);
 
-        // if the inputted path is the same as the directory, set it to the filename
-        if (option == 3 && strcmp(path, aDir->d_name) == 0) {
-            memset(entryName, '\0', sizeof(entryName));
-            strcpy(entryName, aDir->d_name);
+    // Make the new rows durable before the manifest says they are there
+    memset(&m, 0, sizeof(struct manifest));
+    strcpy(m.input, filePath);
+    strcpy(m.key, key);
+    m.size = inputStat.st_size;
+    m.processed = processed;
+    if (inputFingerprint(filePath, processed, &m.fingerprint) == -1 ||
+            (!fresh && syncOutput(dirName) == -1) || writeManifest(outName, &m) == -1) {
+        printf("Could not write the manifest of %s\n", dirName);
+        perror("Error");
+        return;
+    }
+    if (!fresh) {
+        printf("Appended %i new movies to directory %s", count, dirName);
+    }
+    else if (publishOutput(stageName, dirName) == 0) {
+        printf("Created directory with name %s", dirName);
+    }
+}
+
+/*
+* Read a partition file back and fill in its checksum.
+* Returns 0 on success and -1 if it cannot be read.
+*/
+int hashFile(char *dirName, struct checksum *entry) {
+    char path[MAX_KEY_LEN + 300];
+    snprintf(path, sizeof(path), "%s/%s.txt", dirName, entry->key);
+    int fd = statOpen(path, O_RDONLY, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct xxh64 state;
+    char *buffer = statMalloc(HASH_BUFFER);
+    ssize_t nread;
+    xxhInit(&state);
+    entry->rows = 0;
+    entry->bytes = 0;
+    while ((nread = read(fd, buffer, HASH_BUFFER)) > 0) {
+        xxhUpdate(&state, buffer, nread);
+        entry->rows += countRows(buffer, nread);
+        entry->bytes += nread;
+    }
+    free(buffer);
+    statClose(fd);
+    entry->hash = xxhDigest(&state);
+    return (nread == -1) ? -1 : 0;
+}
+
+/*
+* Hashing thread: read back the files of the job until none are left.
+* Files that cannot be read get a byte count of -1.
+*/
+void *hashMain(void *arg) {
+    struct hashJob *job = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        if (hashFile(job->dirName, &job->entries[i]) == -1) {
+            job->entries[i].bytes = -1;
         }
     }
-    
-    // Close the directory
-    closedir(currDir);
-    char *fileName = strdup(entryName);
-    return fileName;
+    mergeStats();
+    return NULL;
 }
 
 /*
-* Free the movie structs in the linked list
+* Checksum partition files of dirName by reading them back on up to
+* --threads threads
 */
-void freeMovie(struct movie *list) {
-    while (list != NULL) {
-        struct movie *temp = list;
-        free(list->title);
-        list = temp->next;
-        free(temp);
+void hashFiles(char *dirName, struct checksum *entries, size_t count) {
+    pthread_t tids[MAX_WORKERS];
+    struct hashJob job = {dirName, entries, count, 0};
+    int numThreads = writerCount();
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+    if ((size_t)numThreads > count) {
+        numThreads = count;
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_create(&tids[i], NULL, hashMain, &job);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(tids[i], NULL);
     }
 }
 
 /*
-* Print the top level user instruction and read in choices
+* Checksum every partition file of dirName by reading it back, for output
+* that several threads appended to
 */
-int instructions() {
-    int i = 0;
-    while (i < 1 || i > 2) {
-        printf("\n1. Select file to process\n"
-                "2. Exit from the program\n"
-                "\nEnter a choice 1 or 2:  ");
-        scanf("%i", &i);
+void checksumTree(char *dirName) {
+    memset(&packFiles, 0, sizeof(packFiles));
+    packFiles.rootLen = strlen(dirName);
+    nftw(dirName, collectPackFile, 16, FTW_PHYS);
+    checksums.entries = calloc(packFiles.count + 1, sizeof(struct checksum));
+    checksums.count = packFiles.count;
+    checksums.cap = packFiles.count + 1;
+    for (size_t i = 0; i < packFiles.count; i++) {
+        checksums.entries[i].key = strdup(packFiles.files[i].key);
+    }
+    freePackList(&packFiles);
+    hashFiles(dirName, checksums.entries, checksums.count);
+}
 
-        // only continue with integer inputs between 1 and 2
-        if (i < 1 || i > 2) {
-            printf("You entered an incorrect choice. Try again.\n");
+/*
+* qsort comparison of two checksums by key
+*/
+int compareChecksums(const void *a, const void *b) {
+    return strcmp(((const struct checksum *)a)->key, ((const struct checksum *)b)->key);
+}
+
+/*
+* Free a list of checksums
+*/
+void freeChecksums(struct checksum *entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].key);
+    }
+    free(entries);
+}
+
+/*
+* Write the checksums of the run to dirName/.checksums, one partition per
+* line as hash, rows, bytes and key, and empty the list
+*/
+void writeChecksums(char *dirName) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s/%s", dirName, CHECKSUMS_NAME);
+    qsort(checksums.entries, checksums.count, sizeof(struct checksum), compareChecksums);
+    FILE *checksumFile = fopen(path, "w");
+    if (checksumFile != NULL) {
+        for (size_t i = 0; i < checksums.count; i++) {
+            struct checksum *entry = &checksums.entries[i];
+            fprintf(checksumFile, "%016llx %lld %lld %s\n", entry->hash, entry->rows, entry->bytes, entry->key);
         }
     }
-    return i;
+    for (size_t i = 0; statsEnabled && i < checksums.count; i++) {
+        struct packList *parts = &runTotals.partitions;
+        if (parts->count == parts->cap) {
+            parts->cap = (parts->cap == 0) ? 256 : parts->cap * 2;
+            parts->files = realloc(parts->files, parts->cap * sizeof(struct packFile));
+        }
+        parts->files[parts->count].key = strdup(checksums.entries[i].key);
+        parts->files[parts->count].size = checksums.entries[i].bytes;
+        parts->count++;
+    }
+    if (checksumFile == NULL || fclose(checksumFile) != 0) {
+        printf("Could not write \"%s\"\n", path);
+        perror("Error");
+    }
+    freeChecksums(checksums.entries, checksums.count);
+    checksums.entries = NULL;
+    checksums.count = 0;
+    checksums.cap = 0;
 }
 
 /*
-* Ask the user what file they want to process and read in choices
+* Check every partition file listed in dirName/.checksums against its row
+* count, size and hash, reading the files on up to --threads threads, and
+* report files that do not match, are missing or are not listed.
+* Returns EXIT_SUCCESS if everything matches.
 */
-int chooseFile() {
-    int i = 0;
-    while (i < 1 || i > 3) {
-        printf("\nWhat file you want to process?\n"
-                "1. Enter 1 to pick the largest file\n"
-                "2. Enter 2 to pick the smallest file\n"
-                "3. Enter 3 to specify the name of a file\n"
-                "\nEnter a choice from 1 to 3:  ");
-        scanf("%i", &i);
+int verifyDir(char *dirName) {
+    char path[300];
+    char *line = NULL;
+    size_t len = 0;
+    size_t count = 0;
+    size_t cap = 0;
+    struct checksum *expected = NULL;
+    snprintf(path, sizeof(path), "%s/%s", dirName, CHECKSUMS_NAME);
+    FILE *checksumFile = fopen(path, "r");
+    if (checksumFile == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    while (getline(&line, &len, checksumFile) != -1) {
+        struct checksum entry;
+        int keyStart = 0;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%llx %lld %lld %n", &entry.hash, &entry.rows, &entry.bytes, &keyStart) != 3 || keyStart == 0) {
+            continue;
+        }
+        if (count == cap) {
+            cap = (cap == 0) ? 256 : cap * 2;
+            expected = realloc(expected, cap * sizeof(struct checksum));
+        }
+        entry.key = strdup(line + keyStart);
+        expected[count++] = entry;
+    }
+    free(line);
+    fclose(checksumFile);
 
-        // only continue with integer inputs between 1 and 3
-        if (i < 1 || i > 3) {
-            printf("You entered an incorrect choice. Try again.\n");
+    struct checksum *actual = calloc(count + 1, sizeof(struct checksum));
+    for (size_t i = 0; i < count; i++) {
+        actual[i].key = strdup(expected[i].key);
+    }
+    hashFiles(dirName, actual, count);
+
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (actual[i].bytes == -1) {
+            printf("MISSING %s\n", expected[i].key);
+            failed++;
+        }
+        else if (actual[i].hash != expected[i].hash || actual[i].rows != expected[i].rows ||
+                actual[i].bytes != expected[i].bytes) {
+            printf("FAILED %s: %lld rows, %lld bytes, hash %016llx; expected %lld rows, %lld bytes, hash %016llx\n",
+                    expected[i].key, actual[i].rows, actual[i].bytes, actual[i].hash,
+                    expected[i].rows, expected[i].bytes, expected[i].hash);
+            failed++;
         }
     }
-    return i;
+
+    // Partition files the checksums do not list
+    qsort(expected, count, sizeof(struct checksum), compareChecksums);
+    memset(&packFiles, 0, sizeof(packFiles));
+    packFiles.rootLen = strlen(dirName);
+    nftw(dirName, collectPackFile, 16, FTW_PHYS);
+    for (size_t i = 0; i < packFiles.count; i++) {
+        struct checksum probe = {packFiles.files[i].key, 0, 0, 0};
+        if (bsearch(&probe, expected, count, sizeof(struct checksum), compareChecksums) == NULL) {
+            printf("UNLISTED %s\n", packFiles.files[i].key);
+            failed++;
+        }
+    }
+    freePackList(&packFiles);
+
+    printf("Verified %zu partition files in %s: %d failed\n", count, dirName, failed);
+    freeChecksums(expected, count);
+    freeChecksums(actual, count);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /*
-* Make directory with files for each year with movies
+* Make directory with files for each partition key with movies, by default
+* one file per year. The chosen file is streamed straight into per
+* partition buffered writers, which are spread over worker threads
+* that each own a disjoint set of partitions. Everything is written into
+* a hidden staging directory that only gets its final name once synced,
+* so a crash never leaves a partly written younga6.movies directory.
+* Several files are parsed concurrently into the same directory.
 */
-void createDir(struct movie *list) {
+void writeOutput(char **filePaths, int numFiles) {
+    if (opts.incremental != NULL) {
+        incrementalDir(filePaths[0]);
+        return;
+    }
 
-    // Head points to start of linked list, allowing to loop back
-    struct movie *head = list;
-    
     // Intialize rng - from 0 to 99999
     time_t t;
     srand((unsigned) time(&t));
-    int random = rand() % 100000;
+    int random;
     char dirName[256];
-    char fileName[256];
-    int fd;
+    char stageName[256];
+    char archiveName[300];
+    struct writerPool pool;
+    struct stat existing;
+
+    removeStaleStaging();
+
+    // Pick a name that is not taken so a previous run is never appended to
+    do {
+        random = rand() % 100000;
+        sprintf(dirName, "./younga6.movies.%i", random);
+        sprintf(archiveName, "%s.pack", dirName);
+    } while (stat(dirName, &existing) == 0 || stat(archiveName, &existing) == 0);
 
     // The new directory will be called younga6.movies.random with rwxr-x--- permissions
-    sprintf(dirName, "./younga6.movies.%i", random);
-    mkdir(dirName, 0750);
+    sprintf(stageName, "./.younga6.movies.%i.tmp", random);
+    if (statMkdir(stageName, 0750) == -1) {
+        printf("mkdir() failed on \"%s\"\n", stageName);
+        perror("Error");
+        return;
+    }
+    // Checksums are taken while writing unless several threads append to a file
+    checksums.streaming = (numFiles == 1 && !opts.mmap);
+    if (numFiles == 1 && opts.mmap) {
+        mapFile(filePaths[0], stageName);
+    }
+    else if (numFiles == 1) {
+        sortSpilled = 0;
+        startWriters(&pool, stageName);
+        processFile(filePaths[0], &pool, 0, NULL);
+        stopWriters(&pool);
+        // Sorted partitions that outgrew the budget were spilled as runs,
+        // so their files only exist after the merge and are checksummed then
+        if (sortSpilled) {
+            mergeSortedRuns(stageName);
+            freeChecksums(checksums.entries, checksums.count);
+            checksumTree(stageName);
+        }
+    }
+    else {
+        processBatch(filePaths, numFiles, stageName);
+        checksumTree(stageName);
+    }
+    checksums.streaming = 0;
+    writeChecksums(stageName);
 
-    // We will loop through every possible year
-    for (int i = 1900; i < 2022; i++) {
-        list = head;
-        
-        // Each new file will be called YYYY.txt for the incrementing year i
-        sprintf(fileName, "%s/%i.txt", dirName, i);
-        while (list != NULL) {
-            // All movies with equivalent years will be added to the file
-            if (list->year == i) {
-                // Initialize movie titles to be added to files
-                char *fileContent;
-                fileContent = calloc(strlen(list->title) + 2, sizeof(char));
-                // We will append new movies on the file, which is created with rw-r----- permissions
-                fd = open(fileName, O_RDWR | O_CREAT | O_APPEND, 0640);
-                if (fd == -1) {
-                    printf("open() failed on \"%s\"\n", fileName);
-                    perror("Error");
-                    exit(1);
-                }
-                sprintf(fileContent, "%s\n", list->title);
-                write(fd, fileContent, strlen(fileContent));
-                close(fd);
-                free(fileContent);
+    // With --archive the directory is packed into younga6.movies.random.pack
+    if (opts.archive) {
+        char stageArchive[300];
+        sprintf(stageArchive, "./.younga6.movies.%i.pack.tmp", random);
+        if (packArchive(stageName, stageArchive) == 0) {
+            if (publishOutput(stageArchive, archiveName) == 0) {
+                printf("Created archive with name younga6.movies.%i.pack", random);
+            }
+            return;
+        }
+    }
+    if (publishOutput(stageName, dirName) == 0) {
+        printf("Created directory with name younga6.movies.%i", random);
+    }
+}
+
+/*
+* Partition the chosen files, timing the run for --stats
+*/
+void createDir(char **filePaths, int numFiles) {
+    long long start = statsEnabled ? statsClock() : 0;
+    writeOutput(filePaths, numFiles);
+    if (statsEnabled) {
+        struct stat inputStat;
+        for (int i = 0; i < numFiles; i++) {
+            if (stat(filePaths[i], &inputStat) == 0) {
+                runTotals.inputBytes += inputStat.st_size;
             }
-            list = list->next;   
         }
+        runTotals.ns += statsClock() - start;
+        runTotals.runs++;
+    }
+}
+
+/*
+* Partition every file a --batch pattern names: the csv files of a
+* directory, or else the files matching a glob
+*/
+int batchMode(char *pattern) {
+    struct stat patternStat;
+    glob_t matches;
+    char dirPattern[300];
+    if (stat(pattern, &patternStat) == 0 && S_ISDIR(patternStat.st_mode)) {
+        snprintf(dirPattern, sizeof(dirPattern), "%s/*.csv", pattern);
+        pattern = dirPattern;
+    }
+    if (glob(pattern, 0, NULL, &matches) != 0 || matches.gl_pathc == 0) {
+        printf("No files match %s\n", pattern);
+        return EXIT_FAILURE;
+    }
+    createDir(matches.gl_pathv, matches.gl_pathc);
+    printf("\n");
+    globfree(&matches);
+    if (statsEnabled) {
+        printStats();
     }
-    printf("Created directory with name younga6.movies.%i", random);
+    return EXIT_SUCCESS;
 }
 
 /*
-*   Follow user instructions to read in files and parce them into 
-*   a linked list of movie structs which are written onto new 
-*   directories and files sorted by year.
+*   Follow user instructions to read in files and stream their
+*   movies into new directories and files sorted by year.
 *   Compile the program as follows:
-*       gcc --std=gnu99 -o movies_by_year main.c
+*       gcc --std=gnu99 -pthread -o movies_by_year main.c
 *   Execute the program using:
-*       ./movies_by_year
+*       ./movies_by_year [--key=year|decade|language|rating|prefix[/...]]
+*                        [--max-open=N] [--threads=N] [--io-uring] [--archive]
+*                        [--sync=syncfs|fdatasync|none] [--incremental=DIR] [--stats]
+*                        [--batch=DIR|GLOB] [--mmap] [--sorted]
+*       ./movies_by_year --extract=ARCHIVE [KEY]
+*       ./movies_by_year --verify=DIR
+*   --key picks what the files are split by, nesting directories for
+*   each level, --max-open caps how many files are kept open at once and
+*   --threads sets the number of writer threads. --io-uring writes the
+*   buffered files in batches through io_uring. --archive packs the output
+*   into one file with an index, which --extract lists or reads a partition of.
+*   --sync picks how the output is flushed before it is renamed into place.
+*   --incremental keeps the output in DIR and only adds rows appended to
+*   the chosen file since the last run. --batch partitions every csv file
+*   of a directory, or every file matching a glob, into one directory
+*   without showing the menu. --mmap counts the bytes of every partition
+*   first, then fills preallocated files through shared mappings. --sorted
+*   lists each file by rating, highest first, then title. Every new
+*   directory gets a .checksums file that --verify checks it against.
+*   With --stats, time and bytes per phase are printed on exit.
 */
 int main(int argc, char *argv[]) {
 
     int fileChoice;
     int cont = 0;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--stats") == 0) {
+            statsEnabled = 1;
+        }
+        else if (strncmp(argv[arg], "--verify=", 9) == 0) {
+            return verifyDir(argv[arg] + 9);
+        }
+        else if (strncmp(argv[arg], "--extract=", 10) == 0) {
+            return extractArchive(argv[arg] + 10, (arg + 1 < argc) ? argv[arg + 1] : NULL);
+        }
+        else if (strncmp(argv[arg], "--sync=", 7) == 0) {
+            opts.sync = -1;
+            for (int i = 0; i < (int)(sizeof(syncNames) / sizeof(syncNames[0])); i++) {
+                if (strcmp(argv[arg] + 7, syncNames[i]) == 0) {
+                    opts.sync = i;
+                }
+            }
+            if (opts.sync == -1) {
+                printf("Invalid sync mode %s\n", argv[arg] + 7);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[arg], "--incremental=", 14) == 0 && argv[arg][14] != '\0') {
+            opts.incremental = argv[arg] + 14;
+            // Trailing slashes would end up inside the partition file names
+            for (size_t end = strlen(opts.incremental); end > 1 && opts.incremental[end - 1] == '/'; end--) {
+                opts.incremental[end - 1] = '\0';
+            }
+        }
+        else if (strncmp(argv[arg], "--batch=", 8) == 0 && argv[arg][8] != '\0') {
+            opts.batch = argv[arg] + 8;
+        }
+        else if (strcmp(argv[arg], "--sorted") == 0) {
+            opts.sorted = 1;
+        }
+        else if (strcmp(argv[arg], "--mmap") == 0) {
+            opts.mmap = 1;
+        }
+        else if (strcmp(argv[arg], "--archive") == 0) {
+            opts.archive = 1;
+        }
+        else if (strcmp(argv[arg], "--io-uring") == 0) {
+            opts.ioUring = 1;
+        }
+        else if (strncmp(argv[arg], "--threads=", 10) == 0) {
+            opts.threads = atoi(argv[arg] + 10);
+        }
+        else if (strncmp(argv[arg], "--max-open=", 11) == 0) {
+            opts.maxOpen = atoi(argv[arg] + 11);
+        }
+        else if (strncmp(argv[arg], "--key=", 6) == 0) {
+            if (parseKey(argv[arg] + 6) == -1) {
+                printf("Invalid partition key %s\n", argv[arg] + 6);
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            printf("Unknown option %s\n", argv[arg]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.incremental != NULL && (opts.archive || opts.batch != NULL || opts.mmap || opts.sorted)) {
+        printf("--incremental cannot be used with --archive, --batch, --mmap or --sorted\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.mmap && (opts.batch != NULL || opts.sorted)) {
+        printf("--mmap cannot be used with --batch or --sorted\n");
+        return EXIT_FAILURE;
+    }
+
+    // A batch run takes its files from the command line instead of the menu
+    if (opts.batch != NULL) {
+        return batchMode(opts.batch);
+    }
     
     // While the program runs, print out instructions and run user choices
     while (cont == 0) {
@@ -287,10 +3902,8 @@ int main(int argc, char *argv[]) {
             // When user wants to look for smallest or biggest size file in the directory
             if (fileChoice == 1 || fileChoice == 2) {
                 path = readDir(fileChoice, "");
-                struct movie *list = processFile(path);
-                // Create new directories and files using the movie struct, then free memory
-                createDir(list);
-                freeMovie(list);
+                // Create new directories and files from the rows of the file
+                createDir(&path, 1);
             }
             
             // When user wants to input their own filename
@@ -306,10 +3919,8 @@ int main(int argc, char *argv[]) {
 
                     // if the file exists, create the new directory and files, otherwise try again
                     if (strcmp(path, path_input) == 0) {
-                        struct movie *list = processFile(path);
-                        createDir(list);
+                        createDir(&path, 1);
                         file_exist = 1;
-                        freeMovie(list);
                     }
 
                     else {
@@ -328,5 +3939,8 @@ int main(int argc, char *argv[]) {
             cont = 1;
         }
     }
+    if (statsEnabled) {
+        printStats();
+    }
     return EXIT_SUCCESS;
 }
@@ -10,13 +10,16 @@
 *  Description: This program implements a smallsh (shell) in C.
 *  This smallsh will provide a prompt for commands,
 *  handle blank lines/comments, provide expansion for $$,
-*  excecute built in exit/cd/status commands, execute other
-*  commands through exec, support I/O redirection, support
-*  running processes in background and foreground, and finally
-*  handle SIGINT and SIGTSTP signals.
+*  excecute built in exit/cd/status/hash commands, execute other
+*  commands through exec with a cache of PATH lookups, support I/O redirection, support
+*  running processes in background and foreground, run pipelines
+*  of commands concurrently, and finally handle SIGINT and SIGTSTP signals.
 * -------------------------------------------------------------
 */
 
+// pipe2 and F_SETPIPE_SZ are Linux extensions
+#define _GNU_SOURCE
+
 /* include header files with libraries that are used */
 #include <fcntl.h>
 #include <dirent.h>
@@ -29,6 +32,12 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#ifdef _POSIX_SPAWN
+#include <spawn.h>
+#endif
+
+extern char **environ;
 
 /*
  * Global variable is used to control if shell is in foreground mode
@@ -49,32 +58,143 @@ struct input {
 };
 
 /*
- * This structure is used to represent the child processes that are stored
- * in the linked list.
+ * This structure is used to represent a child process that has been reaped,
+ * with the status waitpid returned for it.
  */
 struct childProcess {
     int pID;
     int status;
-    struct childProcess *next;
 };
 
 /*
- * This structure is used to represent the linked list.
+ * This structure is used to represent the table of background jobs.
+ * It is an open addressing hash table of process IDs with linear probing,
+ * so adding or removing a job does not depend on how many are running.
+ * Empty slots hold 0, and capacity is always a power of two.
+ */
+struct jobTable {
+    int *slots;
+    int capacity;
+    int count;
+};
+
+/*
+ * This structure is used to represent one command in the command hash table,
+ * the name typed and the absolute path it was found at in PATH.
  */
-struct list {
-    struct childProcess *head;
+struct pathEntry {
+    char *name;
+    char *path;
 };
 
 /*
- * This function will allocate and initialize a new, empty linked list and
+ * This structure is used to represent the command hash table, so the PATH
+ * directories are only searched the first time a command is run. Like the
+ * job table it uses open addressing with linear probing, and empty slots
+ * have a NULL name. smallsh has no built-in command that changes PATH,
+ * so the entries stay valid until hash -r.
+ */
+struct pathCache {
+    struct pathEntry *slots;
+    int capacity;
+    int count;
+};
+
+struct pathCache commands = {NULL, 0, 0};
+
+/*
+ * Children are reaped by the SIGCHLD handler as soon as they exit.
+ * A background child waits in the reaped ring until checkTerminate reports it,
+ * while the foreground pipeline is tracked by the stage process IDs in fg_pids.
+ * fg_left counts the stages still running and fg_status is the last stage's
+ * status. fg_pids and fg_count only change while SIGCHLD is blocked.
+ */
+#define REAPED_SIZE 256
+struct childProcess reaped[REAPED_SIZE];
+volatile sig_atomic_t reaped_head = 0;
+volatile sig_atomic_t reaped_tail = 0;
+pid_t *fg_pids = NULL;
+int fg_count = 0;
+volatile sig_atomic_t fg_left = 0;
+volatile int fg_status = 0;
+
+/*
+ * This function will allocate and initialize a new, empty job table and
  * return a pointer to it.
- * It is transcribed from my CS261 coursework along with other framework for my linked list.
  */
-struct list *list_create() {
-	struct list* list = NULL;
-	list = malloc(sizeof(struct list));
-	list->head = NULL;
-    return list;
+struct jobTable *jobTable_create() {
+    struct jobTable *jobs = malloc(sizeof(struct jobTable));
+    jobs->capacity = 64;
+    jobs->count = 0;
+    jobs->slots = calloc(jobs->capacity, sizeof(int));
+    return jobs;
+}
+
+/*
+ * The jobSlot function returns the slot holding the process ID,
+ * or the empty slot where it would be added
+ */
+int jobSlot(struct jobTable *jobs, int pID) {
+    int mask = jobs->capacity - 1;
+    int i = ((unsigned)pID * 2654435761u) & mask;
+    while (jobs->slots[i] != 0 && jobs->slots[i] != pID) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/*
+ * The addJob function adds a background process to the job table,
+ * doubling the table first if it would become more than half full
+ */
+void addJob(struct jobTable *jobs, int pID) {
+    if ((jobs->count + 1) * 2 > jobs->capacity) {
+        int *old = jobs->slots;
+        int oldCapacity = jobs->capacity;
+        jobs->capacity = oldCapacity * 2;
+        jobs->slots = calloc(jobs->capacity, sizeof(int));
+        for (int i = 0; i < oldCapacity; i++) {
+            if (old[i] != 0) {
+                jobs->slots[jobSlot(jobs, old[i])] = old[i];
+            }
+        }
+        free(old);
+    }
+    int i = jobSlot(jobs, pID);
+    if (jobs->slots[i] == 0) {
+        jobs->slots[i] = pID;
+        jobs->count++;
+    }
+}
+
+/*
+ * The removeJob function removes a process from the job table, returning 1
+ * if it was there. Later entries of the probe run are shifted back into the
+ * freed slot so lookups never need tombstones.
+ */
+int removeJob(struct jobTable *jobs, int pID) {
+    int mask = jobs->capacity - 1;
+    int i = jobSlot(jobs, pID);
+    if (jobs->slots[i] == 0) {
+        return 0;
+    }
+    int j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (jobs->slots[j] == 0) {
+            break;
+        }
+        // An entry can only move back if its home slot is not between the gap and itself
+        int home = ((unsigned)jobs->slots[j] * 2654435761u) & mask;
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+        jobs->slots[i] = jobs->slots[j];
+        i = j;
+    }
+    jobs->slots[i] = 0;
+    jobs->count--;
+    return 1;
 }
 
 /* 
@@ -177,6 +297,47 @@ struct input *createInput(char *currLine) {
     return currCommand;
 }
 
+/*
+*  Split the current line into the stages of a pipeline, which are separated
+*  by " | ", and create an input struct for each stage. The number of stages
+*  is stored in numStages, a line without a pipe being a single stage.
+*  If a stage of a pipeline has no command, as in "ls | ", an error is
+*  printed and NULL is returned before anything is parsed.
+*/
+struct input **createPipeline(char *currLine, int *numStages) {
+    int count = 1;
+    for (char *bar = strstr(currLine, " | "); bar != NULL; bar = strstr(bar + 3, " | ")) {
+        count++;
+    }
+    char *stage = currLine;
+    for (int i = 0; i < count && count > 1; i++) {
+        char *bar = strstr(stage, " | ");
+        size_t len = (bar != NULL) ? (size_t)(bar - stage) : strlen(stage);
+        if (strspn(stage, " ") >= len) {
+            printf("missing command in pipeline\n");
+            fflush(stdout);
+            return NULL;
+        }
+        if (bar != NULL) {
+            stage = bar + 3;
+        }
+    }
+    struct input **stages = malloc(count * sizeof(struct input *));
+    stage = currLine;
+    for (int i = 0; i < count; i++) {
+        char *bar = strstr(stage, " | ");
+        if (bar != NULL) {
+            *bar = '\0';
+        }
+        stages[i] = createInput(stage);
+        if (bar != NULL) {
+            stage = bar + 3;
+        }
+    }
+    *numStages = count;
+    return stages;
+}
+
 /*
  * Custom handler for SIGTSTP changes the shell mode to or from foreground only
  * The handler will also print out the respective mode that has been entered
@@ -192,11 +353,237 @@ void handle_SIGTSTP(int signo){
     return;
 }
 
+/*
+ * The reapForeground function records a reaped child if it is a stage of the
+ * foreground pipeline, returning 1 if it was.
+ */
+int reapForeground(pid_t pID, int status) {
+    for (int i = 0; i < fg_count; i++) {
+        if (fg_pids[i] == pID) {
+            fg_pids[i] = 0;
+            if (i == fg_count - 1) {
+                fg_status = status;
+            }
+            fg_left--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The clearCommands function empties the command hash table,
+ * which is what the built-in command hash -r does
+ */
+void clearCommands() {
+    for (int i = 0; i < commands.capacity; i++) {
+        if (commands.slots[i].name != NULL) {
+            free(commands.slots[i].name);
+            free(commands.slots[i].path);
+        }
+    }
+    free(commands.slots);
+    commands.slots = NULL;
+    commands.capacity = 0;
+    commands.count = 0;
+}
+
+/*
+ * The searchPath function returns the directories commands are searched for in
+ */
+char *searchPath() {
+    char *pathVar = getenv("PATH");
+    // Without PATH, search the same directories execvp does
+    if (pathVar == NULL) {
+        pathVar = "/bin:/usr/bin";
+    }
+    return pathVar;
+}
+
+/*
+ * The hashName function returns the FNV-1a hash of a command name
+ */
+unsigned hashName(char *name) {
+    unsigned hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * The commandSlot function returns the slot holding the command name,
+ * or the empty slot where it would be added
+ */
+int commandSlot(char *name) {
+    int mask = commands.capacity - 1;
+    int i = hashName(name) & mask;
+    while (commands.slots[i].name != NULL && strcmp(commands.slots[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/*
+ * The addCommand function adds a resolved command to the hash table,
+ * doubling the table first if it would become more than half full
+ */
+void addCommand(char *name, char *path) {
+    if ((commands.count + 1) * 2 > commands.capacity) {
+        struct pathEntry *old = commands.slots;
+        int oldCapacity = commands.capacity;
+        commands.capacity = (oldCapacity == 0) ? 64 : oldCapacity * 2;
+        commands.slots = calloc(commands.capacity, sizeof(struct pathEntry));
+        for (int i = 0; i < oldCapacity; i++) {
+            if (old[i].name != NULL) {
+                commands.slots[commandSlot(old[i].name)] = old[i];
+            }
+        }
+        free(old);
+    }
+    int i = commandSlot(name);
+    if (commands.slots[i].name == NULL) {
+        commands.slots[i].name = strdup(name);
+        commands.slots[i].path = strdup(path);
+        commands.count++;
+    }
+}
+
+/*
+ * The forgetCommand function removes a command from the hash table, shifting
+ * later entries of the probe run back the same way removeJob does
+ */
+void forgetCommand(char *name) {
+    if (commands.count == 0) {
+        return;
+    }
+    int mask = commands.capacity - 1;
+    int i = commandSlot(name);
+    if (commands.slots[i].name == NULL) {
+        return;
+    }
+    free(commands.slots[i].name);
+    free(commands.slots[i].path);
+    int j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (commands.slots[j].name == NULL) {
+            break;
+        }
+        int home = hashName(commands.slots[j].name) & mask;
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+        commands.slots[i] = commands.slots[j];
+        i = j;
+    }
+    commands.slots[i].name = NULL;
+    commands.slots[i].path = NULL;
+    commands.count--;
+}
+
+/*
+ * The resolveCommand function returns the path to exec a command at, which the
+ * caller frees, or NULL if it is not in PATH. Names with a slash are used as they
+ * are. Otherwise the hash table is checked first, and on a miss each PATH directory
+ * is searched for an executable file, the same way execvp would.
+ * hashed is set to 1 if the path came from the hash table.
+ */
+char *resolveCommand(char *name, int *hashed) {
+    *hashed = 0;
+    if (strchr(name, '/') != NULL) {
+        return strdup(name);
+    }
+    char *dir = searchPath();
+    if (commands.count > 0) {
+        int i = commandSlot(name);
+        if (commands.slots[i].name != NULL) {
+            *hashed = 1;
+            return strdup(commands.slots[i].path);
+        }
+    }
+
+    size_t nameLen = strlen(name);
+    while (1) {
+        char *end = strchr(dir, ':');
+        size_t dirLen = (end != NULL) ? (size_t)(end - dir) : strlen(dir);
+        // An empty PATH entry is the current directory
+        char *candidate = malloc(dirLen + nameLen + 3);
+        if (dirLen == 0) {
+            snprintf(candidate, nameLen + 3, "./%s", name);
+        }
+        else {
+            snprintf(candidate, dirLen + nameLen + 2, "%.*s/%s", (int)dirLen, dir, name);
+        }
+        struct stat info;
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0) {
+            // Relative directories depend on the working directory, so only absolute paths are kept
+            if (candidate[0] == '/') {
+                addCommand(name, candidate);
+            }
+            return candidate;
+        }
+        free(candidate);
+        if (end == NULL) {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+/*
+ * The listCommands function prints the command hash table,
+ * which is what the built-in command hash does
+ */
+void listCommands() {
+    if (commands.count == 0) {
+        printf("hash table empty\n");
+    }
+    for (int i = 0; i < commands.capacity; i++) {
+        if (commands.slots[i].name != NULL) {
+            printf("%s\t%s\n", commands.slots[i].name, commands.slots[i].path);
+        }
+    }
+    fflush(stdout);
+}
+
+/*
+ * Handler for SIGCHLD reaps every child that has exited with waitpid(-1).
+ * Background children go into the reaped ring and foreground pipeline stages
+ * are counted off in fg_left. When the ring is full the rest are left
+ * as zombies until checkTerminate drains it and calls this handler again.
+ */
+void handle_SIGCHLD(int signo) {
+    int saved_errno = errno;
+    int status;
+    pid_t pID;
+    while (reaped_tail - reaped_head < REAPED_SIZE) {
+        pID = waitpid(-1, &status, WNOHANG);
+        if (pID <= 0) {
+            break;
+        }
+        if (!reapForeground(pID, status)) {
+            reaped[reaped_tail % REAPED_SIZE].pID = pID;
+            reaped[reaped_tail % REAPED_SIZE].status = status;
+            reaped_tail++;
+        }
+    }
+    // The foreground stages are always reaped, even when the ring is full
+    for (int i = 0; i < fg_count; i++) {
+        pID = fg_pids[i];
+        if (pID > 0 && waitpid(pID, &status, WNOHANG) == pID) {
+            reapForeground(pID, status);
+        }
+    }
+    errno = saved_errno;
+    return;
+}
+
 /*
  * The freeInput function is called when freeing an input struct
  * It dealocates the memory allocated in the struct and then the memory of the struct
  * This is called after every main loop (before the next prompt) because all foreground processes
- * will be complete at this point and all background processes are stored in the linked list.
+ * will be complete at this point and all background processes are stored in the job table.
  */
 void freeInput(struct input *temp) {
     free(temp->command);
@@ -213,231 +600,571 @@ void freeInput(struct input *temp) {
 }
 
 /*
- * The freeList function frees the linked list of background processes
+ * The freeJobs function frees the table of background processes
  * It is only called when the exit command is processed
  * It also terminates all background processes
  */
-void freeList(struct list* list) {
-	if (list != NULL) {	
-		struct childProcess* current;
-		while (list->head != NULL) {
-			current = list->head;
-			list->head = list->head->next;
-            kill(current->pID, SIGTERM);
-			free(current);
-		}
-		free(list);
-	}
-    return;
-}
-
-/*
- * The freeProcess function removes a link from the linked list after the 
- * process terminates normally. Again the basis for this function comes
- * from CS261 coursework on linked lists. 
- */
-void freeProcess(struct childProcess *current, struct list *list) {
-    if (list != NULL) {
-        struct childProcess *temp = list->head;
-        if (temp != NULL && temp->pID == current->pID) {
-            list->head = temp->next;
-            free(temp);
-            return;
-        }
-        while (temp->next != NULL) {
-			if (temp->next->pID == current->pID) {
-				struct childProcess *temp_c = temp->next;
-				temp->next = temp->next->next;
-				free(temp_c);
-				return;
-			}
-		temp = temp->next;
-        }   
+void freeJobs(struct jobTable *jobs) {
+    if (jobs != NULL) {
+        for (int i = 0; i < jobs->capacity; i++) {
+            if (jobs->slots[i] != 0) {
+                kill(jobs->slots[i], SIGTERM);
+            }
+        }
+        free(jobs->slots);
+        free(jobs);
     }
     return;
 }
 
 /*
- * The checkTerminate function checks if a background function has terminated.
- * This function is necessary to avoid defunct processes and is called right
- * before returning access to the command line to the user
+ * The checkTerminate function reports the background processes that have terminated.
+ * They have already been reaped by handle_SIGCHLD, so this only drains the reaped ring
+ * and removes each one from the job table. It is called right before returning access
+ * to the command line to the user.
  */
-void checkTerminate(struct list *list) {
-    struct childProcess *curr = list->head;
-    int wait_result;
-
-    // Starting at the head, this will iterate through every background process stored in the list
-    while (curr != NULL) {
-        struct childProcess *temp = curr->next;
-        int status = curr->status;
+void checkTerminate(struct jobTable *jobs) {
+    sigset_t blocked, oldMask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &oldMask);
 
-        // The restult of waitpid will be the same as the pid with WNOHANG if the process has terminated
-        wait_result = waitpid(curr->pID, &status, WNOHANG);
-        if (wait_result == curr->pID) {
-            if (WIFEXITED(status)) {
-                printf("background pid %d is done: exit value %d\n", curr->pID, WEXITSTATUS(status));
-                fflush(stdout);
-                freeProcess(curr, list);
+    // Reap here too, in case the ring was full when the handler last ran
+    handle_SIGCHLD(SIGCHLD);
+    while (reaped_head != reaped_tail) {
+        struct childProcess curr = reaped[reaped_head % REAPED_SIZE];
+        reaped_head++;
+        if (removeJob(jobs, curr.pID)) {
+            if (WIFEXITED(curr.status)) {
+                printf("background pid %d is done: exit value %d\n", curr.pID, WEXITSTATUS(curr.status));
             }
             else {
-                printf("background pid %d is done: terminated by signal %d\n", curr->pID, WTERMSIG(status));
-                fflush(stdout);
-                freeProcess(curr, list);
+                printf("background pid %d is done: terminated by signal %d\n", curr.pID, WTERMSIG(curr.status));
             }
+            fflush(stdout);
         }
-        else if (wait_result == -1) {
-            perror("Error");
-            exit(0);
+        if (reaped_head == reaped_tail) {
+            handle_SIGCHLD(SIGCHLD);
         }
-        curr = temp;
     }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
 }
 
 /*
- * The createChildProcess is a robust function that
- * forks a child, handles redirection, and execs the command.
- * This function returns the status outputted from waitpid
- * to be used by the in-built status command later.
- * A foreground status is passed into the function to be returned
- * if the input is a background process (and we dont call waitpid)
+ * The shellArgs function returns the arguments that run a file without a #!
+ * line as a /bin/sh script, the way execvp does when exec fails with ENOEXEC:
+ * /bin/sh, the path of the file and then the command's own arguments.
+ * The caller frees the array but not the strings.
  */
-int createChildProcess(struct input *commandLine, struct list *list, int f_status) {
+char **shellArgs(struct input *commandLine, char *path) {
+    char **args = malloc((commandLine->arg_num + 2) * sizeof(char *));
+    args[0] = "/bin/sh";
+    args[1] = path;
+    for (int i = 1; i <= commandLine->arg_num; i++) {
+        args[i + 1] = commandLine->arg[i];
+    }
+    return args;
+}
+
+/*
+ * The staleCommand function returns 1 if a launch failed because the hashed
+ * path of the command no longer exists, so it should be looked up again
+ */
+int staleCommand(int error, char *path, int hashed) {
+    return error == ENOENT && hashed && access(path, F_OK) == -1;
+}
+
+/*
+ * The failChild function ends a forked child that could not exec its command.
+ * The errno of the failure is sent up the exec-status pipe first, so the
+ * shell learns the launch failed as soon as it happens.
+ */
+void failChild(int reportFD) {
+    int error = errno;
+    if (write(reportFD, &error, sizeof(error)) == -1) {
+        perror("write");
+    }
+    exit(1);
+}
+
+/*
+ * The execChild function runs in a forked child. It sets up the signals and
+ * redirection of the child and then execs the command, never returning.
+ * The exec-status pipe reportFD is close-on-exec, so a successful exec closes it.
+ * In a pipeline, pipeIn and pipeOut are the pipe ends the stage reads and writes
+ * unless it redirects them to files, and are -1 otherwise.
+ * path is where resolveCommand found the command, or NULL if it was not found,
+ * and hashed is set if it came from the hash table.
+ */
+void execChild(struct input *commandLine, char *path, int hashed, int reportFD, int pipeIn, int pipeOut) {
     int result;
-    int status = 0;
-    pid_t newChild = fork();
+    // Here we setup all child processes to SIG_IGN (ignore) the SIGTSTP signal
+    struct sigaction ignore_action = {0};
+    ignore_action.sa_handler = SIG_IGN;
+    ignore_action.sa_flags = SA_RESTART;
+    sigaction(SIGTSTP, &ignore_action, NULL);
+    // The child starts with the shell's SIGCHLD block, which it does not keep
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
 
-    if (newChild < 0) {
-        perror("Error");
-        exit(0);
+    // if there is an input file, redirect input accordingly with dup2
+    if (commandLine->input_f == 1) {
+        int sourceFD = open(commandLine->input_file, O_RDONLY);
+        if (sourceFD == -1) {
+            printf("cannot open %s for input\n", commandLine->input_file);
+            fflush(stdout);
+            failChild(reportFD);
+        }
+        result = dup2(sourceFD, 0);
+        // In the case of an error, print it out
+        if (result == -1) {
+            perror(commandLine->input_file);
+            failChild(reportFD);
+        }
     }
-    // Case where we are the child process that has been forked to
-    else if (newChild == 0) {
-        // Here we setup all child processes to SIG_IGN (ignore) the SIGTSTP signal
-        struct sigaction ignore_action = {0};
+
+    // if there is no input file and the stage reads from a pipe, redirect input to it
+    else if (pipeIn != -1) {
+        if (dup2(pipeIn, 0) == -1) {
+            perror("dup2");
+            failChild(reportFD);
+        }
+    }
+
+    // if there is no input file and input is to be run in background
+    // then redirect input to /dev/null with dup2
+    else if (commandLine->input_f == 0 && commandLine->background == 1) {
+        int sourceFD = open("/dev/null", O_RDONLY);
+        if (sourceFD == -1) {
+            perror("/dev/null");
+            failChild(reportFD);
+        }
+        result = dup2(sourceFD, 0);
+        if (result == -1) {
+            perror("/dev/null");
+            failChild(reportFD);
+        }
+    }
+
+    // if there is an output file, redirect output accordingly with dup2
+    if (commandLine->output_f == 1) {
+        int targetFD = open(commandLine->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (targetFD == -1) {
+            printf("cannot open %s for output\n", commandLine->output_file);
+            fflush(stdout);
+            failChild(reportFD);
+        }
+        result = dup2(targetFD, 1);
+        if (result == -1) {
+            perror(commandLine->output_file);
+            failChild(reportFD);
+        }
+    }
+
+    // if there is no output file and the stage writes to a pipe, redirect output to it
+    else if (pipeOut != -1) {
+        if (dup2(pipeOut, 1) == -1) {
+            perror("dup2");
+            failChild(reportFD);
+        }
+    }
+
+    // if there is no output file and output is to be run in background
+    // then redirect output to /dev/null with dup2
+    else if (commandLine->output_f == 0 && commandLine->background == 1) {
+        int targetFD = open("/dev/null", O_WRONLY);
+        if (targetFD == -1) {
+            perror("/dev/null");
+            failChild(reportFD);
+        }
+        result = dup2(targetFD, 1);
+        if (result == -1) {
+            perror("/dev/null");
+            failChild(reportFD);
+        }
+    }
+
+    // Here we setup all foreground child processes to SIG_DFL (default action) 
+    // when catching the the SIGINT signal. We do not use a custom handler
+    // for the active portion of SIGINT because it is the same as the default action
+    if (commandLine->background == 0) {
+        struct sigaction def_action = {0};
+        def_action.sa_handler = SIG_DFL;
+        def_action.sa_flags = SA_RESTART;
+        sigaction(SIGINT, &def_action, NULL);
+    }
+
+    // After handling all redirection, execve is called on the resolved command and its arguments
+    if (path == NULL) {
+        errno = ENOENT;
+        perror(commandLine->command);
+        failChild(reportFD);
+    }
+    result = execve(path, commandLine->arg, environ);
+    // A file without a #! line is run as a shell script, as execvp would
+    if (result == -1 && errno == ENOEXEC) {
+        result = execve("/bin/sh", shellArgs(commandLine, path), environ);
+    }
+    if (result == -1) {
+        // A hashed path that has gone away fails quietly, the shell looks it up again
+        int error = errno;
+        if (!staleCommand(error, path, hashed)) {
+            perror(commandLine->command);
+        }
+        errno = error;
+        failChild(reportFD);
+    }
+
+    // Should never reach here, this is just for safety
+    exit(0);
+}
+
+#ifdef _POSIX_SPAWN
+/*
+ * The openRedirect function opens one redirection file for a spawned child
+ * in the shell itself, close-on-exec so only the child's dup2 copy survives.
+ * Without a file, background children get /dev/null instead.
+ * It returns the descriptor, -2 if there is nothing to redirect or -1 on error.
+ */
+int openRedirect(int redirect, char *file, int background, int flags, char *direction) {
+    if (redirect == 1) {
+        int fd = open(file, flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            printf("cannot open %s for %s\n", file, direction);
+            fflush(stdout);
+        }
+        return fd;
+    }
+    if (background == 1) {
+        int fd = open("/dev/null", (flags & O_WRONLY) ? O_WRONLY | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror("/dev/null");
+        }
+        return fd;
+    }
+    return -2;
+}
+
+/*
+ * The spawnChild function is the fast path for launching a command. Instead
+ * of copying the shell with fork, posix_spawn starts the child sharing the
+ * shell's memory until it execs. The redirection files are opened here and
+ * handed over as dup2 file actions, and the signal setup of a forked child
+ * is done with spawn attributes: the signal mask is cleared, foreground
+ * children get the default SIGINT action and SIGTSTP stays ignored.
+ * Pipeline stages are given their pipe ends the same way as files.
+ * The command is run from the path resolveCommand finds for it, and if that
+ * path no longer exists it is dropped from the hash table and looked up again.
+ * A file without a #! line is run with /bin/sh, as execvp would.
+ * It returns the new process ID, -1 if the command could not be started, or -2
+ * if posix_spawn is not supported here and the command should be forked instead.
+ */
+pid_t spawnChild(struct input *commandLine, int pipeIn, int pipeOut) {
+    pid_t newChild = -1;
+    int inFD = -2;
+    int outFD = -2;
+    if (commandLine->input_f == 1 || pipeIn == -1) {
+        inFD = openRedirect(commandLine->input_f, commandLine->input_file, commandLine->background,
+                O_RDONLY, "input");
+    }
+    if (inFD != -1 && (commandLine->output_f == 1 || pipeOut == -1)) {
+        outFD = openRedirect(commandLine->output_f, commandLine->output_file, commandLine->background,
+                O_WRONLY | O_CREAT | O_TRUNC, "output");
+    }
+
+    if (inFD != -1 && outFD != -1) {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t defaults, empty, blocked, oldMask;
+        posix_spawn_file_actions_init(&actions);
+        if (inFD >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, inFD, 0);
+        }
+        else if (commandLine->input_f == 0 && pipeIn != -1) {
+            posix_spawn_file_actions_adddup2(&actions, pipeIn, 0);
+        }
+        if (outFD >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, outFD, 1);
+        }
+        else if (commandLine->output_f == 0 && pipeOut != -1) {
+            posix_spawn_file_actions_adddup2(&actions, pipeOut, 1);
+        }
+
+        // Foreground children take the default action on SIGINT, which the shell ignores
+        posix_spawnattr_init(&attr);
+        sigemptyset(&empty);
+        sigemptyset(&defaults);
+        if (commandLine->background == 0) {
+            sigaddset(&defaults, SIGINT);
+        }
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        posix_spawnattr_setsigmask(&attr, &empty);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+        // A caught signal is reset to default across exec, so SIGTSTP is ignored
+        // while spawning for the child to inherit. It stays blocked meanwhile,
+        // so a SIGTSTP sent now is kept and handled once the handler is back.
+        struct sigaction ignore_action = {0}, old_action;
         ignore_action.sa_handler = SIG_IGN;
         ignore_action.sa_flags = SA_RESTART;
-        sigaction(SIGTSTP, &ignore_action, NULL);
-
-        // if there is an input file, redirect input accordingly with dup2
-        if (commandLine->input_f == 1) {
-            int sourceFD = open(commandLine->input_file, O_RDONLY);
-            if (sourceFD == -1) {
-                printf("cannot open %s for input\n", commandLine->input_file);
-                fflush(stdout);
-                exit(1);
-            }
-            result = dup2(sourceFD, 0);
-            // In the case of an error, print it out
-            if (result == -1) {
-                perror(commandLine->input_file);
-                exit(1);
+        sigemptyset(&blocked);
+        sigaddset(&blocked, SIGTSTP);
+        sigprocmask(SIG_BLOCK, &blocked, &oldMask);
+        sigaction(SIGTSTP, &ignore_action, &old_action);
+
+        int result = ENOENT;
+        int hashed;
+        char *path = resolveCommand(commandLine->command, &hashed);
+        if (path != NULL) {
+            result = posix_spawn(&newChild, path, &actions, &attr, commandLine->arg, environ);
+        }
+        if (staleCommand(result, path, hashed)) {
+            forgetCommand(commandLine->command);
+            free(path);
+            path = resolveCommand(commandLine->command, &hashed);
+            if (path != NULL) {
+                result = posix_spawn(&newChild, path, &actions, &attr, commandLine->arg, environ);
             }
         }
+        if (result == ENOEXEC) {
+            char **args = shellArgs(commandLine, path);
+            result = posix_spawn(&newChild, "/bin/sh", &actions, &attr, args, environ);
+            free(args);
+        }
+        free(path);
 
-        // if there is no input file and input is to be run in background
-        // then redirect input to /dev/null with dup2
-        else if (commandLine->input_f == 0 && commandLine->background == 1) {
-            int sourceFD = open("/dev/null", O_RDONLY);
-            if (sourceFD == -1) {
-                perror("/dev/null");
-                exit(1);
-            }
-            result = dup2(sourceFD, 0);
-            if (result == -1) {
-                perror("/dev/null");
-                exit(1);
-            }
+        sigaction(SIGTSTP, &old_action, NULL);
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        if (result == ENOSYS) {
+            newChild = -2;
         }
+        else if (result != 0) {
+            errno = result;
+            perror(commandLine->command);
+            fflush(stderr);
+            newChild = -1;
+        }
+    }
 
-        // if there is an output file, redirect output accordingly with dup2
-        if (commandLine->output_f == 1) {
-            int targetFD = open(commandLine->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (targetFD == -1) {
-                printf("cannot open %s for output\n", commandLine->output_file);
-                fflush(stdout);
-                exit(1);
-            }
-            result = dup2(targetFD, 1);
-            if (result == -1) {
-                perror(commandLine->output_file);
-                exit(1);
-            }
+    if (inFD >= 0) {
+        close(inFD);
+    }
+    if (outFD >= 0) {
+        close(outFD);
+    }
+    return newChild;
+}
+#endif
+
+/*
+ * The forkMode function returns 1 if commands are to be forked rather than
+ * spawned, which is asked for by setting the SMALLSH_FORK environment variable
+ */
+int forkMode() {
+    return getenv("SMALLSH_FORK") != NULL;
+}
+
+/*
+ * The forkChild function is the fallback for launching a command where
+ * posix_spawn is not available or not supported, or when SMALLSH_FORK is set.
+ * The child reports whether its exec succeeded through a close-on-exec pipe,
+ * so the launch is settled when this returns.
+ * A child that failed is reaped here, SIGCHLD being blocked by the caller,
+ * so a failed launch is reported the same way as on the spawn path.
+ * It returns the new process ID, or -1 if the command could not be started.
+ */
+pid_t forkChild(struct input *commandLine, int pipeIn, int pipeOut) {
+    // The command is looked up in the shell, so the hash table keeps what is found
+    int hashed;
+    char *path = resolveCommand(commandLine->command, &hashed);
+    pid_t newChild;
+    ssize_t got;
+    while (1) {
+        // The child reports whether its exec succeeded through this pipe
+        int report[2];
+        if (pipe2(report, O_CLOEXEC) == -1) {
+            perror("pipe");
+            fflush(stderr);
+            free(path);
+            return -1;
         }
+        newChild = fork();
 
-        // if there is no output file and output is to be run in background
-        // then redirect output to /dev/null with dup2
-        else if (commandLine->output_f == 0 && commandLine->background == 1) {
-            int targetFD = open("/dev/null", O_WRONLY);
-            if (targetFD == -1) {
-                perror("/dev/null");
-                exit(1);
-            }
-            result = dup2(targetFD, 1);
-            if (result == -1) {
-                perror("/dev/null");
-                exit(1);
-            }
+        if (newChild < 0) {
+            perror("Error");
+            exit(0);
+        }
+        // Case where we are the child process that has been forked to
+        else if (newChild == 0) {
+            close(report[0]);
+            execChild(commandLine, path, hashed, report[1], pipeIn, pipeOut);
         }
 
-        // Here we setup all foreground child processes to SIG_DFL (default action) 
-        // when catching the the SIGINT signal. We do not use a custom handler
-        // for the active portion of SIGINT because it is the same as the default action
-        if (commandLine->background == 0) {
-            struct sigaction def_action = {0};
-            def_action.sa_handler = SIG_DFL;
-            def_action.sa_flags = SA_RESTART;
-            sigaction(SIGINT, &def_action, NULL);
+        // Reading the pipe returns nothing once the child has exec'd, or the
+        // errno it sent if it failed, in which case its error is already printed
+        int error;
+        close(report[1]);
+        do {
+            got = read(report[0], &error, sizeof(error));
+        } while (got == -1 && errno == EINTR);
+        close(report[0]);
+
+        // A child that could not exec is reaped now instead of becoming a job
+        if (got > 0) {
+            waitpid(newChild, NULL, 0);
+            newChild = -1;
         }
 
-        // After handling all redirection, execvp is called on the input command and its arguments
-        result = execvp(commandLine->command, commandLine->arg);
-        if (result == -1) {
-            perror(commandLine->command);
-            exit(1);
+        // A hashed path that no longer exists is dropped and looked up again once
+        if (got > 0 && staleCommand(error, path, hashed)) {
+            forgetCommand(commandLine->command);
+            free(path);
+            path = resolveCommand(commandLine->command, &hashed);
+            continue;
         }
+        break;
+    }
+    free(path);
+    return newChild;
+}
 
-        // Should never reach here, this is just for safety
-        exit(0);
+/*
+ * The pipeSize function returns the pipe buffer size requested with the
+ * SMALLSH_PIPE_SIZE environment variable, or 0 to keep the default
+ */
+int pipeSize() {
+    char *size = getenv("SMALLSH_PIPE_SIZE");
+    if (size == NULL) {
+        return 0;
     }
-    
-    // If the current process is the parent, print the pid if it is a
-    // background process. If it a foreground process, wait for it to terminate.
-    else if (newChild > 0) {
-        if (commandLine->background == 1) {
-            // Sleep so that if command fails, prompt prints correctly
-            // This handles some prompt out errors but does cause a slight delay in
-            // outputting the prompt after a background process is inputted
-            sleep(1);
-            printf("background pid is %i\n", newChild);
-            fflush(stdout);
+    long bytes = strtol(size, NULL, 10);
+    if (bytes <= 0 || bytes > INT_MAX) {
+        return 0;
+    }
+    return (int)bytes;
+}
+
+/*
+ * The createChildProcess is a robust function that
+ * starts the children of a pipeline, handles redirection, and execs the commands.
+ * A single command is a pipeline of one stage. Each stage's output is connected
+ * to the next stage's input by a pipe, and all stages run at the same time.
+ * Where posix_spawn is available the children are spawned unless SMALLSH_FORK
+ * is set, otherwise they are forked and set themselves up before calling exec. Either way a
+ * failed launch is known before this function returns.
+ * This function returns the status the last stage exited with
+ * to be used by the in-built status command later.
+ * A foreground status is passed into the function to be returned
+ * if the input is a background process (and we dont wait for it)
+ * SIGCHLD stays blocked until the children are in the job table or
+ * marked as the foreground pipeline, so the handler cannot miss them.
+ */
+int createChildProcess(struct input **stages, int numStages, struct jobTable *jobs, int f_status) {
+    int status = 0;
+    int background = stages[0]->background;
+    int bufferSize = pipeSize();
+    pid_t *pids = malloc(numStages * sizeof(pid_t));
+    sigset_t blocked, oldMask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &oldMask);
+
+    // Each stage reads the pipe left by the one before it. The pipes are
+    // close-on-exec, so every child only keeps the ends it was given.
+    int pipeIn = -1;
+    int pipeFailed = 0;
+    for (int i = 0; i < numStages; i++) {
+        int pipeFDs[2] = {-1, -1};
+        if (i < numStages - 1) {
+            // Without the pipe the rest of the pipeline is not started. The stages
+            // already running lose their reader and are waited for as usual.
+            if (pipe2(pipeFDs, O_CLOEXEC) == -1) {
+                perror("pipe");
+                fflush(stderr);
+                if (pipeIn != -1) {
+                    close(pipeIn);
+                }
+                for (int j = i; j < numStages; j++) {
+                    pids[j] = -1;
+                }
+                pipeFailed = 1;
+                break;
+            }
+            if (bufferSize > 0 && fcntl(pipeFDs[1], F_SETPIPE_SZ, bufferSize) == -1) {
+                perror("SMALLSH_PIPE_SIZE");
+            }
         }
-        else {
-            waitpid(newChild, &status, 0);
+        pids[i] = -2;
+#ifdef _POSIX_SPAWN
+        if (!forkMode()) {
+            pids[i] = spawnChild(stages[i], pipeIn, pipeFDs[1]);
+        }
+#endif
+        if (pids[i] == -2) {
+            pids[i] = forkChild(stages[i], pipeIn, pipeFDs[1]);
+        }
+        if (pipeIn != -1) {
+            close(pipeIn);
+        }
+        if (pipeFDs[1] != -1) {
+            close(pipeFDs[1]);
         }
+        pipeIn = pipeFDs[0];
     }
 
-    // Check how foreground process terminated, return the status of waitpid
-    if (commandLine->background == 0) {
-        if (WIFEXITED(status)) {
-            return(status);
+    // If the current process is the parent, print the pid of every stage if it is a
+    // background process and add them to the job table. A stage that could not
+    // be started is skipped.
+    if (background == 1) {
+        for (int i = 0; i < numStages; i++) {
+            if (pids[i] != -1) {
+                addJob(jobs, pids[i]);
+            }
         }
-        else if (WIFSIGNALED(status)) {
-            printf("terminated by signal %d\n", WTERMSIG(status));
-            fflush(stdout);
-            return(status);
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+        for (int i = 0; i < numStages; i++) {
+            if (pids[i] != -1) {
+                printf("background pid is %i\n", pids[i]);
+            }
         }
+        fflush(stdout);
+        free(pids);
+        return pipeFailed ? W_EXITCODE(1, 0) : f_status;
     }
-    // If we are a background process, create a link in the linked list to store
-    // the process ID and status of the current process. This will be used to 
-    // check if any background processes have terminated later on.
-    else {
-        struct childProcess *node = malloc(sizeof(struct childProcess));
-        node->pID = newChild;
-        node->status = status;
-        node->next = list->head;
-        list->head = node;
+
+    // If it is a foreground process, sleep in sigsuspend until the SIGCHLD handler
+    // has reaped every stage. A last stage that could not be started, or was never
+    // started because a pipe could not be made, counts as exiting with value 1.
+    fg_left = 0;
+    fg_status = W_EXITCODE(1, 0);
+    for (int i = 0; i < numStages; i++) {
+        if (pids[i] == -1) {
+            pids[i] = 0;
+        }
+        else {
+            fg_left++;
+        }
+    }
+    fg_pids = pids;
+    fg_count = numStages;
+    while (fg_left > 0) {
+        sigsuspend(&oldMask);
+    }
+    status = fg_status;
+    fg_pids = NULL;
+    fg_count = 0;
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    free(pids);
+
+    // Check how foreground process terminated, return its status
+    if (WIFSIGNALED(status)) {
+        printf("terminated by signal %d\n", WTERMSIG(status));
+        fflush(stdout);
     }
-    return f_status;
+    return status;
 }
 
 /*
@@ -465,7 +1192,7 @@ int main(int argc, char *argv[]) {
     // This also will affect the child processes when we fork, which is why
     // I only update the SIG_INT of the foreground processes which are affected
     // by the SIG_INT signal
-    struct sigaction ignore_action = {0}, SIGTSTP_action = {0};
+    struct sigaction ignore_action = {0}, SIGTSTP_action = {0}, SIGCHLD_action = {0};
 	ignore_action.sa_handler = SIG_IGN;
     // All my sigaction calls use SA_RESTART as the flag, this especially helps
     // when trying to catch signals on the prompt during getline()
@@ -477,6 +1204,11 @@ int main(int argc, char *argv[]) {
     SIGTSTP_action.sa_handler = handle_SIGTSTP;
     SIGTSTP_action.sa_flags = SA_RESTART;
     sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+    // Children are reaped by handle_SIGCHLD as soon as they exit, rather than
+    // waiting for the next prompt. Stopped children are not reported.
+    SIGCHLD_action.sa_handler = handle_SIGCHLD;
+    SIGCHLD_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &SIGCHLD_action, NULL);
 
     // These variables are used in the main function to reformat the input, check for continues,
     // give the environment variable HOME, and store the status for the in-built status command
@@ -490,8 +1222,8 @@ int main(int argc, char *argv[]) {
     long processID = getpid();
     char ID_string[32];
     int status = 0;
-    // Create a list of processes that we can access through the head
-    struct list *processes = list_create();
+    // Create a table of background processes keyed by process ID
+    struct jobTable *processes = jobTable_create();
     
     // While the program continues to run, prompt the user and execute commands
     while (cont == 0) {
@@ -550,26 +1282,38 @@ int main(int argc, char *argv[]) {
         // Keep in mind that this does not error check the syntax, and extra spaces may cause seg faults
         // strsep may be better to use to tokenize in the future
         else {
-            struct input *newInput = createInput(input);
-            // Now that the input is in the struct, we can update if it will run as a background process or not
-            if (fg_mode || normalAnd) {
-                newInput->background = 0;
+            int numStages;
+            struct input **stages = createPipeline(input, &numStages);
+            // A pipeline with an empty stage is not run at all, and fails like a command that could not start
+            if (stages == NULL) {
+                status = W_EXITCODE(1, 0);
+                free(input);
+                continue;
             }
-            else if (!normalAnd) {
-                newInput->background = 1;
+            struct input *newInput = stages[0];
+            // Now that the input is in the structs, we can update if it will run as a background process or not
+            for (int i = 0; i < numStages; i++) {
+                if (fg_mode || normalAnd) {
+                    stages[i]->background = 0;
+                }
+                else if (!normalAnd) {
+                    stages[i]->background = 1;
+                }
             }
             
             // If the user uses built-in command exit, free the current
             // input struct, input string, and background processes.
-            if (strcmp(newInput->command, "exit") == 0) {
+            // Built-in commands are only run on their own, not in a pipeline.
+            if (numStages == 1 && strcmp(newInput->command, "exit") == 0) {
                 freeInput(newInput);
+                free(stages);
                 free(input);
-                freeList(processes);
+                freeJobs(processes);
                 exit(0);
             }
 
             // If the user uses built-in command cd, call the changeDir function with correct path
-            else if (strcmp(newInput->command, "cd") == 0) {
+            else if (numStages == 1 && strcmp(newInput->command, "cd") == 0) {
                 if (newInput->arg[1] == NULL) {
                     changeDir(home_path);
                 } else {
@@ -579,7 +1323,7 @@ int main(int argc, char *argv[]) {
 
             // If the user uses built-in command status, check how the process terminated with the status
             // If it terminated normally, print the exit value, if it was terminated by signal, print signal num
-            else if (strcmp(newInput->command, "status") == 0) {
+            else if (numStages == 1 && strcmp(newInput->command, "status") == 0) {
                 if (WIFEXITED(status)) {
                     printf("exit value %i\n", WEXITSTATUS(status));
                     fflush(stdout);
@@ -590,12 +1334,26 @@ int main(int argc, char *argv[]) {
                 }
             }
 
+            // If the user uses built-in command hash, list the commands in the hash table,
+            // or with -r empty it so every command is searched for in PATH again
+            else if (numStages == 1 && strcmp(newInput->command, "hash") == 0) {
+                if (newInput->arg[1] != NULL && strcmp(newInput->arg[1], "-r") == 0) {
+                    clearCommands();
+                }
+                else {
+                    listCommands();
+                }
+            }
+
             // If the command is not built-in create a child to call the exec libary of functions on
             else {
-                status = createChildProcess(newInput, processes, status);
+                status = createChildProcess(stages, numStages, processes, status);
+            }
+            // At the end of processing each command input, free the input structs and input string
+            for (int i = 0; i < numStages; i++) {
+                freeInput(stages[i]);
             }
-            // At the end of processing each command input, free the input struct and input string
-            freeInput(newInput);
+            free(stages);
             free(input);
         }
     }